@@ -0,0 +1,360 @@
+/*
+	htpbench
+
+	Compare the backends of libhtpdate (poll, epoll and io_uring) with
+	the classic blocking path of htpdate 1.2.0: system calls, CPU time
+	and round trip time jitter of the same polls.
+
+	All web servers are submitted at once, every round; the blocking
+	path polls them one after the other. Each runs twice in a child
+	process: once on its own, for CPU time and jitter, and once traced
+	with ptrace(2) to count its system calls (the tracing itself would
+	spoil the timing). A backend which is not available is skipped.
+
+	Build with "make ENABLE_IO_URING=1 all htpbench", it is not installed.
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+	http://www.gnu.org/copyleft/gpl.html
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "htpdate.h"
+
+#define	MAX_HOSTS				64
+#define	MAX_ROUNDS				1000
+#define	NAP						100000			/* us, between samples */
+#define	BLOCKING				-1				/* Not a backend */
+
+struct stats {
+	int			skipped;				/* Backend not available */
+	long		samples, errors;
+	long		syscalls;
+	double		cpu;					/* ms */
+	double		rtt;					/* ms, mean */
+	double		jitter;					/* ms, standard deviation */
+};
+
+
+static void showhelp() {
+	puts("htpbench, libhtpdate version "HTPDATE_VERSION"\n\
+Usage: htpbench [-c count] [-n rounds] [-w when] host[:port] ...\n\n\
+  -c    samples per web server per round (default 1)\n\
+  -n    number of rounds (default 10)\n\
+  -w    microseconds past the second for the first sample (default 500000)\n\
+  host  web server hostname or ip address, plain HTTP\n");
+}
+
+
+/* Errors only, like a missing io_uring */
+static void logmessage( void *arg, int is_error, const char *message ) {
+	if ( is_error )
+		fprintf( stderr, "%s\n", message );
+}
+
+
+/* The classic blocking path, as htpdate 1.2.0 polled: resolve, connect,
+   sleep till "when", send the request and wait for the response.
+   Returns the round trip time, or -1 without a Date: header.
+*/
+static long blockingpoll( const char *url, int when ) {
+	struct addrinfo			hints, *res, *res0;
+	struct timeval			tv;
+	struct timespec			nap;
+	char					buffer[1024], host[HTP_HOSTSIZE], *port, *end;
+	long long				sent;
+	ssize_t					n;
+	int						fd = -1;
+
+	if ( strncmp( url, "http://", 7 ) == 0 )
+		url += 7;
+	snprintf( host, sizeof(host), "%s", url );
+	if ( host[0] == '[' && (end = strchr( host, ']' )) ) {
+		*end = '\0';
+		memmove( host, host + 1, strlen( host + 1 ) + 1 );
+		port = end[1] == ':' ? end + 1 : "80";
+	} else {
+		port = (end = strrchr( host, ':' )) ? end + 1 : "80";
+		if ( end )
+			*end = '\0';
+	}
+
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo( host, port, &hints, &res0 ) )
+		return(-1);
+	for ( res = res0; res; res = res->ai_next ) {
+		if ( (fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol )) < 0 )
+			continue;
+		if ( connect( fd, res->ai_addr, res->ai_addrlen ) == 0 )
+			break;
+		close( fd );
+		fd = -1;
+	}
+	freeaddrinfo( res0 );
+	if ( fd < 0 )
+		return(-1);
+
+	/* Wait till we reach the desired time, "when" */
+	gettimeofday( &tv, NULL );
+	nap.tv_sec = 0;
+	nap.tv_nsec = ( ( when - tv.tv_usec + 1000000 ) % 1000000 ) * 1000L;
+	nanosleep( &nap, NULL );
+
+	snprintf( buffer, sizeof(buffer), "HEAD / HTTP/1.1\r\nHost: %s\r\nUser-Agent: htpdate/"HTPDATE_VERSION"\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n", host );
+	gettimeofday( &tv, NULL );
+	sent = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	if ( send( fd, buffer, strlen( buffer ), MSG_NOSIGNAL ) < 0 || \
+	  (n = recv( fd, buffer, sizeof(buffer) - 1, 0 )) <= 0 ) {
+		close( fd );
+		return(-1);
+	}
+	gettimeofday( &tv, NULL );
+	close( fd );
+
+	buffer[n] = '\0';
+	if ( strstr( buffer, "Date: " ) == NULL )
+		return(-1);
+	return( (long long)tv.tv_sec * 1000000 + tv.tv_usec - sent );
+}
+
+
+/* Poll all web servers for rounds, the samples go to stats */
+static void run( int backend, char *hosts[], int nhosts, int rounds, int count, int when, struct stats *stats ) {
+	static long				rtts[MAX_HOSTS][MAX_ROUNDS * HTP_MAX_SAMPLES];
+	long					nrtts[MAX_HOSTS];
+	struct htp_options		options;
+	struct htp_ctx			*ctx = NULL;
+	struct htp_result		result;
+	struct rusage			usage;
+	double					sum = 0, mean, dev = 0;
+	long					rtt;
+	int						ids[MAX_HOSTS];
+	int						r, h, i;
+
+	memset( stats, 0, sizeof(*stats) );
+	memset( nrtts, 0, sizeof(nrtts) );
+
+	if ( backend != BLOCKING ) {
+		memset( &options, 0, sizeof(options) );
+		options.backend = backend;
+		options.log = logmessage;
+		if ( (ctx = htp_new( &options )) == NULL )
+			exit(1);
+		if ( htp_backend( ctx ) != backend ) {
+			stats->skipped = 1;
+			htp_free( ctx );
+			return;
+		}
+	}
+
+	for ( r = 0; r < rounds; r++ ) {
+		if ( backend == BLOCKING ) {
+			for ( h = 0; h < nhosts; h++ ) {
+				for ( i = 0; i < count; i++ ) {
+					if ( (rtt = blockingpoll( hosts[h], \
+					  ( when + i * NAP ) % 1000000 )) < 0 ) {
+						stats->errors++;
+						continue;
+					}
+					rtts[h][nrtts[h]++] = rtt;
+					stats->samples++;
+				}
+			}
+			continue;
+		}
+
+		for ( h = 0; h < nhosts; h++ )
+			ids[h] = htp_submit( ctx, hosts[h], when, count, NAP );
+		htp_wait( ctx );
+
+		while ( htp_result( ctx, &result ) ) {
+			for ( h = 0; h < nhosts && ids[h] != result.id; h++ );
+			if ( h == nhosts || result.status != HTP_OK ) {
+				stats->errors++;
+				continue;
+			}
+			rtts[h][nrtts[h]++] = result.rtt;
+			stats->samples++;
+		}
+	}
+
+	htp_free( ctx );
+
+	getrusage( RUSAGE_SELF, &usage );
+	stats->cpu = ( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1e3 + \
+		( usage.ru_utime.tv_usec + usage.ru_stime.tv_usec ) * 1e-3;
+
+	/* Jitter is the deviation from the mean round trip time of each
+	   web server, pooled over all of them
+	*/
+	if ( stats->samples == 0 )
+		return;
+	for ( h = 0; h < nhosts; h++ ) {
+		for ( i = 0; i < nrtts[h]; i++ )
+			sum += rtts[h][i];
+	}
+	stats->rtt = sum / stats->samples * 1e-3;
+	for ( h = 0; h < nhosts; h++ ) {
+		for ( i = 0, mean = 0; i < nrtts[h]; i++ )
+			mean += rtts[h][i];
+		mean /= nrtts[h] ? nrtts[h] : 1;
+		for ( i = 0; i < nrtts[h]; i++ )
+			dev += ( rtts[h][i] - mean ) * ( rtts[h][i] - mean );
+	}
+	stats->jitter = sqrt( dev / stats->samples ) * 1e-3;
+}
+
+
+/* Count the system calls of the child, and all its threads.
+   Every system call stops twice, at entry and at exit.
+*/
+static long countsyscalls( pid_t pid ) {
+	long					stops = 0;
+	pid_t					tid;
+	int						status, sig;
+
+	if ( waitpid( pid, &status, 0 ) < 0 || !WIFSTOPPED(status) )
+		return(-1);
+	ptrace( PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | \
+		PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL );
+	ptrace( PTRACE_SYSCALL, pid, NULL, NULL );
+
+	while ( (tid = waitpid( -1, &status, __WALL )) > 0 ) {
+		if ( tid == pid && ( WIFEXITED(status) || WIFSIGNALED(status) ) )
+			break;
+		if ( !WIFSTOPPED(status) )
+			continue;
+
+		sig = 0;
+		if ( WSTOPSIG(status) == (SIGTRAP | 0x80) )
+			stops++;
+		else if ( WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP )
+			sig = WSTOPSIG(status);
+		ptrace( PTRACE_SYSCALL, tid, NULL, sig );
+	}
+
+	return( stops / 2 );
+}
+
+
+/* Benchmark one backend, or the blocking path */
+static int bench( int backend, char *hosts[], int nhosts, int rounds, int count, int when, struct stats *stats ) {
+	struct stats			traced;
+	int						fds[2];
+	pid_t					pid;
+
+	if ( pipe( fds ) < 0 )
+		return(-1);
+
+	/* Timing run */
+	if ( (pid = fork()) == 0 ) {
+		run( backend, hosts, nhosts, rounds, count, when, stats );
+		if ( write( fds[1], stats, sizeof(*stats) ) < 0 )
+			_exit(1);
+		_exit(0);
+	}
+	if ( pid < 0 || read( fds[0], stats, sizeof(*stats) ) != sizeof(*stats) )
+		return(-1);
+	waitpid( pid, NULL, 0 );
+	close( fds[0] );
+	close( fds[1] );
+	if ( stats->skipped )
+		return(0);
+
+	/* Traced run */
+	if ( (pid = fork()) == 0 ) {
+		ptrace( PTRACE_TRACEME, 0, NULL, NULL );
+		raise( SIGSTOP );
+		run( backend, hosts, nhosts, rounds, count, when, &traced );
+		_exit(0);
+	}
+	if ( pid < 0 )
+		return(-1);
+	stats->syscalls = countsyscalls( pid );
+
+	return(0);
+}
+
+
+int main( int argc, char *argv[] ) {
+	static const int		backends[] = { BLOCKING, HTP_BACKEND_POLL, \
+		HTP_BACKEND_EPOLL, HTP_BACKEND_URING };
+	struct stats			stats;
+	const char				*name;
+	int						rounds = 10, count = 1, when = 500000;
+	int						param, nhosts, b;
+
+	while ( (param = getopt( argc, argv, "c:hn:w:" )) != -1 ) {
+		switch ( param ) {
+		case 'c':
+			count = atoi( optarg );
+			if ( count < 1 || count > HTP_MAX_SAMPLES ) {
+				fputs( "Invalid count\n", stderr );
+				exit(1);
+			}
+			break;
+		case 'n':
+			rounds = atoi( optarg );
+			if ( rounds < 1 || rounds > MAX_ROUNDS ) {
+				fputs( "Invalid number of rounds\n", stderr );
+				exit(1);
+			}
+			break;
+		case 'w':
+			when = atoi( optarg ) % 1000000;
+			break;
+		default:
+			showhelp();
+			exit(1);
+		}
+	}
+
+	nhosts = argc - optind;
+	if ( nhosts < 1 || nhosts > MAX_HOSTS ) {
+		showhelp();
+		exit(1);
+	}
+
+	printf( "%d web servers, %d rounds of %d samples\n\n", nhosts, rounds, count );
+	printf( "%-10s %8s %7s %9s %9s %9s %11s\n", "backend", "samples", \
+		"errors", "syscalls", "cpu (ms)", "rtt (ms)", "jitter (ms)" );
+	for ( b = 0; b < (int)(sizeof(backends) / sizeof(backends[0])); b++ ) {
+		name = backends[b] == BLOCKING ? "blocking" : htp_backendname( backends[b] );
+		fflush( stdout );
+		if ( bench( backends[b], argv + optind, nhosts, rounds, count, when, &stats ) ) {
+			fprintf( stderr, "%s: benchmark failed\n", name );
+			continue;
+		}
+		if ( stats.skipped ) {
+			fprintf( stderr, "%s: not available, skipped\n", name );
+			continue;
+		}
+		printf( "%-10s %8ld %7ld %9ld %9.2f %9.3f %11.3f\n", name, \
+			stats.samples, stats.errors, stats.syscalls, stats.cpu, \
+			stats.rtt, stats.jitter );
+	}
+
+	return(0);
+}
+
+/* vim: set ts=4 sw=4: */
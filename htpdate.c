@@ -40,23 +40,24 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <netdb.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/timex.h>
 #include <syslog.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <grp.h>
 
-#define VERSION 				"1.2.0"
+#include "htpdate.h"
+
+#define VERSION 				HTPDATE_VERSION
 #define	MAX_HTTP_HOSTS			15				/* 16 web servers */
-#define	DEFAULT_HTTP_PORT		"80"
-#define	DEFAULT_PROXY_PORT		"8080"
-#define	DEFAULT_IP_VERSION		PF_UNSPEC		/* IPv6 and IPv4 */
+#define	DEFAULT_IP_VERSION		0				/* IPv6 and IPv4 */
 #define	DEFAULT_HTTP_VERSION	"1"				/* HTTP/1.1 */
 #define	DEFAULT_TIME_LIMIT		31536000		/* 1 year */
 #define	DEFAULT_MIN_SLEEP		1800			/* 30 minutes */
@@ -64,8 +65,16 @@
 #define	MAX_DRIFT				32768000		/* 500 PPM */
 #define	MAX_ATTEMPT				2				/* Poll attempts */
 #define	DEFAULT_PID_FILE		"/var/run/htpdate.pid"
-#define	URLSIZE					128
-#define	BUFFERSIZE				1024
+#define	SURVEY_SAMPLES			8				/* Per web server */
+#define	DEFAULT_SURVEY_BUDGET	256				/* Concurrent polls */
+#define	DEFAULT_SURVEY_RATE		100				/* New polls per second */
+#define	TRACE_EVENTS			1024			/* Trace buffer of a poll */
+#define	SURVEY_TRACE_EVENTS		65536			/* Trace buffer of a survey */
+#define	STATE_GAIN				0.25			/* Of a new sample in the scores */
+#define	STATE_RTT				100000			/* Round trip time halving the score, us */
+#define	STATE_NEW				0.75			/* Reach of a new web server */
+#define	STATE_BAD				0.5				/* Share that makes a web server bad */
+#define	STATE_LINE				512
 
 #define sign(x) (x < 0 ? (-1) : 1)
 
@@ -73,264 +82,873 @@
 /* By default we turn off "debug" and "log" mode  */
 static int		debug = 0;
 static int		logmode = 0;
+static FILE		*tracefile = NULL;
 
 
-/* Make mktime timezone agnostic, see manpage timegm */
-time_t gmtmktime (struct tm *tm)
-{
-    char *tz;
-    time_t result;
+/* Printlog is a slighty modified version from the one used in rdate */
+static void printlog( int is_error, char *format, ... ) {
+	va_list args;
+	char buf[128];
+
+	va_start(args, format);
+	(void) vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
 
-    /* Temporarily set timezone to UTC for conversion */
-    tz = getenv("TZ");
-    if (tz) {
-		tz = strdup (tz);
+    if ( logmode )
+		syslog(is_error?LOG_WARNING:LOG_INFO, "%s", buf);
+	else
+		fprintf(is_error?stderr:stdout, "%s\n", buf);
+}
+
+
+/* Drop or elevate privileges */
+static void swuid( int id ) {
+	if ( seteuid( id ) ) {
+		printlog( 1, "seteuid() %i", id );
+		exit(1);
 	}
-    setenv("TZ", "", 1);
-    tzset();
+}
+static void swgid( int id ) {
+	if ( setegid( id ) ) {
+		printlog( 1, "setegid() %i", id );
+		exit(1);
+	}
+}
 
-    result = mktime (tm);
 
-    /* Restore timezone */
-    if (tz) {
-      setenv("TZ", tz, 1);
-      free (tz);
-    }
-    else {
-      unsetenv("TZ");
-    }
-    tzset();
+/* Debug output and the messages of libhtpdate are kept till the polls
+   are done, so printing doesn't disturb the measurement. One message
+   after the other, each starts with '!' if it is an error.
+*/
+static char		*deferred = NULL;
+static size_t	ndeferred = 0, maxdeferred = 0;
+
+static void deferlog( int is_error, char *format, ... ) {
+	va_list args;
+	char buf[128], *more;
+	size_t len;
 
-    return result;
+	va_start(args, format);
+	(void) vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	len = strlen( buf ) + 2;
+	if ( ndeferred + len > maxdeferred ) {
+		if ( (more = realloc( deferred, maxdeferred * 2 + 4096 )) == NULL ) {
+			printlog( is_error, "%s", buf );
+			return;
+		}
+		deferred = more;
+		maxdeferred = maxdeferred * 2 + 4096;
+	}
+
+	deferred[ndeferred] = is_error ? '!' : ' ';
+	memcpy( deferred + ndeferred + 1, buf, len - 1 );
+	ndeferred += len;
 }
 
 
-/* Insertion sort is more efficient (and smaller) than qsort for small lists */
-static void insertsort( int a[], int length ) {
-	int i, j, value;
+/* Print the messages kept, after the polls */
+static void flushlog( void ) {
+	size_t				i;
+
+	for ( i = 0; i < ndeferred; i += strlen( deferred + i ) + 1 )
+		printlog( deferred[i] == '!', "%s", deferred + i + 1 );
+	ndeferred = 0;
+}
+
+
+/* Messages of libhtpdate */
+static void logmessage( void *arg, int is_error, const char *message ) {
+	deferlog( is_error, "%s", message );
+}
 
-	for ( i = 1; i < length; i++ ) {
-		value = a[i];
-		for ( j = i - 1; j >= 0 && a[j] > value; j-- )
-			a[j+1] = a[j];
-		a[j+1] = value;
+
+/* Take the trace events of the polls, after the measurement, and dump
+   them to the trace file. In debug mode, host is told about its
+   connection.
+*/
+/* One line of the trace file */
+static void writetrace( struct htp_event *event ) {
+	fprintf( tracefile, "%lld.%06lld %d %d %s %lld\n", \
+		event->time / 1000000, event->time % 1000000, event->id, \
+		event->sample, htp_event_name( event->type ), event->value );
+}
+
+
+static void showtrace( struct htp_ctx *ctx, char *host ) {
+	struct htp_event	events[64];
+	int					i, n;
+
+	while ( (n = htp_trace( ctx, events, 64 )) > 0 ) {
+		for ( i = 0; i < n; i++ ) {
+			if ( tracefile )
+				writetrace( &events[i] );
+			if ( !debug || host == NULL )
+				continue;
+			if ( events[i].type == HTP_EV_CONNECT && events[i].value == 0 )
+				deferlog( 0, "%s reusing proxy connection", host );
+			if ( events[i].type == HTP_EV_TLS )
+				deferlog( 0, "%s TLSv1.%lld, session %s", host, \
+					( events[i].value >> 1 & 0xff ) - 1, \
+					events[i].value & 1 ? "resumed" : "new" );
+		}
 	}
+
+	if ( tracefile )
+		fflush( tracefile );
 }
 
 
-/* Split argument in hostname/IP-address and TCP port
-   Supports IPv6 literal addresses, RFC 2732.
+/* Trace events lost, the buffer was too small */
+static void showdropped( struct htp_ctx *ctx ) {
+	if ( htp_trace_dropped( ctx ) )
+		printlog( 0, "%lu trace events dropped", htp_trace_dropped( ctx ) );
+}
+
+
+/* Print host, raw timestamp, round trip time */
+static void showresult( struct htp_result *result ) {
+	struct tm			tm;
+	time_t				remote;
+	char				remote_time[25];
+
+	remote = result->received / 1000000 + result->offset;
+	gmtime_r( &remote, &tm );
+	strftime( remote_time, sizeof(remote_time), "%d %b %Y %T GMT", &tm );
+	deferlog( 0, "%-25s %s %s (%.3f) => %li", result->host, result->port, \
+		remote_time, result->rtt * 1e-6, result->offset );
+}
+
+
+/* Quality of a web server as time source, learned over the polls and
+   kept in the state file (-f) across runs. The shares are moving
+   averages, every new sample or poll cycle counts for STATE_GAIN.
 */
-static void splithostport( char **host, char **port ) {
-	char    *rb, *rc, *lb, *lc;
-
-	lb = strchr( *host, '[' );
-	rb = strrchr( *host, ']' );
-	lc = strchr( *host, ':' );
-	rc = strrchr( *host, ':' );
-
-	/* A (litteral) IPv6 address with portnumber */
-	if ( rb < rc && lb != NULL && rb != NULL ) {
-		rb[0] = '\0';
-	    *port = rc + 1;
-		*host = lb + 1;
+struct source {
+	char				*url;
+	long				polls;				/* Poll cycles */
+	double				reach;				/* Share of poll cycles answered */
+	double				rtt;				/* Round trip time, us */
+	double				jitter;				/* Mean deviation of the rtt, us */
+	double				falseticker;		/* Share of false tickers */
+	int					failures;			/* Poll cycles in a row gone bad */
+	time_t				retry;				/* Skipped till then */
+	int					answered;			/* In this poll cycle */
+};
+
+
+/* Read the state of the web servers, web servers which are no longer
+   used are forgotten; the new ones start out as reachable, but not more
+   than one timeout away from bad
+*/
+static void stateread( char *file, struct source sources[], int n ) {
+	struct source		s;
+	FILE				*fp;
+	char				line[STATE_LINE], url[STATE_LINE];
+	long				retry;
+	int					i;
+
+	for ( i = 0; i < n; i++ )
+		sources[i].reach = STATE_NEW;
+
+	if ( (fp = fopen( file, "r" )) == NULL )
 		return;
+
+	while ( fgets( line, sizeof(line), fp ) ) {
+		if ( line[0] == '#' || sscanf( line, "%511s %ld %lf %lf %lf %lf %d %ld", \
+		  url, &s.polls, &s.reach, &s.rtt, &s.jitter, &s.falseticker, \
+		  &s.failures, &retry ) != 8 )
+			continue;
+		for ( i = 0; i < n; i++ ) {
+			if ( strcmp( sources[i].url, url ) )
+				continue;
+			s.url = sources[i].url;
+			s.retry = retry;
+			s.answered = 0;
+			sources[i] = s;
+		}
 	}
 
-    /* A (litteral) IPv6 address without portnumber */
-	if ( rb != NULL && lb != NULL ) {
-		rb[0] = '\0';
-		*host = lb + 1;
+	fclose( fp );
+}
+
+
+/* Replace the state file, never leave half of one */
+static void statewrite( char *file, struct source sources[], int n ) {
+	FILE				*fp;
+	char				tmp[PATH_MAX];
+	int					fd, i;
+
+	snprintf( tmp, sizeof(tmp), "%s.tmp", file );
+	if ( (fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 )) < 0 || \
+	  (fp = fdopen( fd, "w" )) == NULL ) {
+		if ( fd >= 0 )
+			close( fd );
+		printlog( 1, "Can't write %s", tmp );
 		return;
 	}
 
-	/* A IPv4 address or hostname with portnumber */
-	if ( rc != NULL && lc == rc ) {
-		rc[0] = '\0';
-		*port = rc + 1;
-		return;
+	fputs( "# url polls reach rtt(us) jitter(us) falseticker failures retry\n", fp );
+	for ( i = 0; i < n; i++ )
+		fprintf( fp, "%s %ld %.3f %.0f %.0f %.3f %d %ld\n", sources[i].url, \
+			sources[i].polls, sources[i].reach, sources[i].rtt, \
+			sources[i].jitter, sources[i].falseticker, sources[i].failures, \
+			(long)sources[i].retry );
+
+	if ( fclose( fp ) || rename( tmp, file ) ) {
+		printlog( 1, "Can't write %s", file );
+		unlink( tmp );
 	}
 }
 
 
-/* Printlog is a slighty modified version from the one used in rdate */
-static void printlog( int is_error, char *format, ... ) {
-	va_list args;
-	char buf[128];
+/* Higher is better: answered, no false ticker and close by */
+static double statescore( struct source *s ) {
+	return( s->reach * ( 1 - s->falseticker ) / \
+		( 1 + ( s->rtt + 4 * s->jitter ) / STATE_RTT ) );
+}
 
-	va_start(args, format);
-	(void) vsnprintf(buf, sizeof(buf), format, args);
-	va_end(args);
 
-    if ( logmode )
-		syslog(is_error?LOG_WARNING:LOG_INFO, "%s", buf);
-	else
-		fprintf(is_error?stderr:stdout, "%s\n", buf);
+static struct source *sorting;
+
+static int compare_source( const void *a, const void *b ) {
+	double				sa = statescore( &sorting[*(int *)a] );
+	double				sb = statescore( &sorting[*(int *)b] );
+
+	if ( sa != sb )
+		return( sa < sb ? 1 : -1 );
+	return( *(int *)a - *(int *)b );
 }
 
 
-/* Drop or elevate privileges */
-static void swuid( int id ) {
-	if ( seteuid( id ) ) {
-		printlog( 1, "seteuid() %i", id );
-		exit(1);
+/* The web servers to poll in this cycle, best first. Those which went
+   bad are skipped till their retry time, unless all of them did.
+*/
+static int stateorder( struct source sources[], int n, int order[] ) {
+	time_t				now = time( NULL );
+	int					i, count = 0;
+
+	for ( i = 0; i < n; i++ ) {
+		sources[i].answered = 0;
+		if ( sources[i].retry <= now )
+			order[count++] = i;
+		else if ( debug )
+			printlog( 0, "%s skipped, retry in %ld s", sources[i].url, \
+				(long)( sources[i].retry - now ) );
+	}
+	if ( count == 0 ) {
+		for ( i = 0; i < n; i++ )
+			order[i] = i;
+		count = n;
+	}
+
+	sorting = sources;
+	qsort( order, count, sizeof(int), compare_source );
+
+	if ( debug ) {
+		for ( i = 0; i < count; i++ )
+			printlog( 0, "%-25s score %.3f", sources[order[i]].url, \
+				statescore( &sources[order[i]] ) );
 	}
+
+	return( count );
 }
-static void swgid( int id ) {
-	if ( setegid( id ) ) {
-		printlog( 1, "setegid() %i", id );
-		exit(1);
+
+
+/* Learn from a sample, whether the web server answered at all is
+   counted once per poll cycle, retries don't count twice
+*/
+static void statesample( struct source *s, struct htp_result *result ) {
+	double				deviation;
+
+	if ( result->status != HTP_OK )
+		return;
+
+	s->answered = 1;
+	if ( s->rtt == 0 ) {
+		s->rtt = result->rtt;
+		return;
 	}
+	deviation = result->rtt > s->rtt ? result->rtt - s->rtt : s->rtt - result->rtt;
+	s->jitter += STATE_GAIN * ( deviation - s->jitter );
+	s->rtt += STATE_GAIN * ( result->rtt - s->rtt );
 }
 
 
-static long getHTTPdate( char *host, char *port, char *proxy, char *proxyport, char *httpversion, int ipversion, int when ) {
-	int					server_s;
-	int					rc;
-	struct addrinfo		hints, *res, *res0;
-	struct tm			tm;
-	struct timeval		timevalue = {LONG_MAX, 0};
-	struct timeval		timeofday;
-	struct timespec		sleepspec, remainder;
-	long				rtt;
-	char				buffer[BUFFERSIZE] = { '\0' };
-	char				remote_time[25] = { '\0' };
-	char				url[URLSIZE] = { '\0' };
-	char				*pdate = NULL;
-
-
-	/* Connect to web server via proxy server or directly */
-	memset( &hints, 0, sizeof(hints) );
-	switch( ipversion ) {
-		case 4:					/* IPv4 only */
-			hints.ai_family = AF_INET;
+/* Learn from the time deltas of a poll cycle, which ones were false
+   tickers (more than a second off the mean). A web server which mostly
+   doesn't answer or is mostly a false ticker, by the moving averages and
+   not by one timeout, is skipped for a while: minsleep and twice as long
+   after every next bad cycle, up to maxsleep.
+*/
+static void statecycle( struct source sources[], int order[], int count, int timedelta[], int from[], int validtimes, int goodtimes, int mean, int minsleep, int maxsleep ) {
+	struct source		*s;
+	long				backoff;
+	int					i;
+
+	for ( i = 0; goodtimes && i < validtimes; i++ ) {
+		s = &sources[from[i]];
+		s->falseticker += STATE_GAIN * ( ( timedelta[i] - mean > 1 || \
+			timedelta[i] - mean < -1 ) - s->falseticker );
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		s = &sources[order[i]];
+		s->polls++;
+		s->reach += STATE_GAIN * ( s->answered - s->reach );
+		if ( s->reach >= STATE_BAD && s->falseticker <= STATE_BAD ) {
+			s->failures = 0;
+			s->retry = 0;
+			continue;
+		}
+		s->failures++;
+		backoff = (long)minsleep << ( s->failures < 16 ? s->failures - 1 : 15 );
+		s->retry = time( NULL ) + ( backoff < maxsleep ? backoff : maxsleep );
+	}
+}
+
+
+/* The mean of the good time deltas, weighted by the score of their
+   web server
+*/
+static double stateaverage( struct source sources[], int timedelta[], int from[], int validtimes, int mean, double timeavg ) {
+	double				sum = 0, weights = 0, weight;
+	int					i;
+
+	for ( i = 0; i < validtimes; i++ ) {
+		if ( timedelta[i] - mean > 1 || timedelta[i] - mean < -1 )
+			continue;
+		weight = statescore( &sources[from[i]] );
+		sum += weight * timedelta[i];
+		weights += weight;
+	}
+
+	return( weights > 0 ? sum / weights : timeavg );
+}
+
+
+/* Poll a web server count times, the first at "when" and the next ones
+   nap microseconds apart (pipelined), and store the time deltas in
+   timedelta[]. Returns the number of polls that succeeded, before the
+   first one that failed. The samples go to the quality of source.
+   Nothing is printed till all polls are done, not to disturb them.
+*/
+static int getHTTPdate( struct htp_ctx *ctx, struct source *source, int when, int nap, int count, long timedelta[] ) {
+	struct htp_result	results[HTP_MAX_SAMPLES], result;
+	char				*url = source->url;
+	int					i, id, n = 0, good = count;
+
+	/* Not polled, assume correct time */
+	if ( (id = htp_submit( ctx, url, when, count, nap )) < 0 ) {
+		for ( i = 0; i < count; i++ )
+			timedelta[i] = 0;
+		return(0);
+	}
+	if ( tracefile )
+		fprintf( tracefile, "# %d %s\n", id, url );
+
+	htp_wait( ctx );
+
+	while ( htp_result( ctx, &result ) ) {
+		if ( n < HTP_MAX_SAMPLES )
+			results[n++] = result;
+	}
+
+	showtrace( ctx, n ? results[0].host : NULL );
+
+	for ( i = 0; i < n; i++ ) {
+		result = results[i];
+		if ( debug && result.status == HTP_OK )
+			showresult( &result );
+		switch ( result.status ) {
+		case HTP_OK:
+			timedelta[result.sample] = result.offset;
 			break;
-		case 6:					/* IPv6 only */
-			hints.ai_family = AF_INET6;
+		case HTP_ERR_RESOLVE:
+		case HTP_ERR_CONNECT:
+		case HTP_ERR_TUNNEL:
+		case HTP_ERR_TLS:
+			timedelta[result.sample] = 0;		/* Assume correct time */
 			break;
-		default:				/* Support IPv6 and IPv4 name resolution */
-			hints.ai_family = PF_UNSPEC;
+		default:
+			timedelta[result.sample] = LONG_MAX;	/* Fails sanity check */
+		}
+		if ( result.status != HTP_OK && result.sample < good )
+			good = result.sample;
 	}
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_CANONNAME;
 
-	if ( proxy == NULL ) {
-		rc = getaddrinfo( host, port, &hints, &res0 );
-	} else {
-		snprintf( url, URLSIZE, "http://%s:%s", host, port);
-		rc = getaddrinfo( proxy, proxyport, &hints, &res0 );
+	/* Samples after the first failed one are polled again, one by one,
+	   a web server closing the connection is no bad time source
+	*/
+	for ( i = 0; i < n; i++ ) {
+		if ( results[i].sample < good )
+			statesample( source, &results[i] );
 	}
 
-	/* Was the hostname and service resolvable? */
-	if ( rc ) {
-		printlog( 1, "%s host or service unavailable", host );
-		return(0);				/* Assume correct time */
+	return( good );
+}
+
+
+/* Survey mode: poll a large list of web servers, a few hundred at the
+   time, and report how good they are as time source.
+
+   Every web server gets SURVEY_SAMPLES samples, pipelined on one
+   keep-alive connection a second and a fraction apart, so they are
+   spread over the second. Web servers which don't keep the connection
+   alive get the missing samples polled one by one.
+*/
+struct survey {
+	char				*url;
+	char				host[HTP_HOSTSIZE];
+	char				port[8];
+	int					when;				/* Of the first sample */
+	int					left;				/* Samples still to come */
+	int					retried;
+	int					status[SURVEY_SAMPLES];
+	long				offsets[SURVEY_SAMPLES];
+	long				rtts[SURVEY_SAMPLES];
+	long				phases[SURVEY_SAMPLES];	/* At the web server, us */
+	int					httpversion, keepalive;
+
+	/* The result */
+	int					error, falseticker, nsamples;
+	double				offset, rtt, jitter;
+	long				phase;				/* Date: rollover, -1 if unknown */
+};
+
+/* A poll of count samples of a web server, from sample on */
+struct surveypoll {
+	int					server, sample, count, when;
+};
+
+
+/* Read the web servers, one per line; # starts a comment */
+static struct survey *surveyread( char *file, int *count ) {
+	struct survey		*servers = NULL, *more;
+	FILE				*fp;
+	char				line[HTP_HOSTSIZE + 16], *url, *end;
+	int					n = 0, max = 0, lineno = 0, c;
+
+	fp = strcmp( file, "-" ) ? fopen( file, "r" ) : stdin;
+	if ( fp == NULL ) {
+		printlog( 1, "Can't open %s", file );
+		exit(1);
 	}
 
-	/* Build a combined HTTP/1.0 and 1.1 HEAD request
-	   Pragma: no-cache, "forces" an HTTP/1.0 and 1.1 compliant
-	   web server to return a fresh timestamp
-	   Connection: close, allows the server the immediately close the
-	   connection after sending the response.
-	*/
-	snprintf(buffer, BUFFERSIZE, "HEAD %s/ HTTP/1.%s\r\nHost: %s\r\nUser-Agent: htpdate/"VERSION"\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n", url, httpversion, host);
+	while ( fgets( line, sizeof(line), fp ) ) {
+		lineno++;
 
-	/* Loop through the available canonical names */
-	res = res0;
-	do {
-		server_s = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
-		if ( server_s < 0 ) {
+		/* Not a web server, skip the rest of the line */
+		if ( strchr( line, '\n' ) == NULL && !feof( fp ) ) {
+			printlog( 1, "%s: line %d too long, skipped", file, lineno );
+			while ( (c = getc( fp )) != EOF && c != '\n' );
 			continue;
 		}
 
-		rc = connect( server_s, res->ai_addr, res->ai_addrlen );
-		if ( rc ) {
-			close( server_s);
-			server_s = -1;
+		if ( (end = strchr( line, '#' )) )
+			*end = '\0';
+		for ( url = line; *url == ' ' || *url == '\t'; url++ );
+		for ( end = url + strlen( url ); end > url && \
+		  ( end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || \
+		  end[-1] == '\t' ); end-- );
+		*end = '\0';
+		if ( *url == '\0' )
 			continue;
+
+		if ( n == max ) {
+			max = max * 2 + 256;
+			if ( (more = realloc( servers, max * sizeof(*servers) )) == NULL ) {
+				printlog( 1, "Out of memory" );
+				exit(1);
+			}
+			servers = more;
 		}
+		memset( &servers[n], 0, sizeof(servers[n]) );
+		servers[n].url = strdup( url );
+		snprintf( servers[n].host, HTP_HOSTSIZE, "%.*s", HTP_HOSTSIZE - 1, url );
+		servers[n].phase = -1;
+		n++;
+	}
+
+	if ( fp != stdin )
+		fclose( fp );
+
+	*count = n;
+	return( servers );
+}
+
 
-		break;
-	} while ( ( res = res->ai_next ) );
+static int compare_long( const void *a, const void *b ) {
+	return( *(const long *)a < *(const long *)b ? -1 : \
+		*(const long *)a > *(const long *)b );
+}
 
-	freeaddrinfo(res0);
 
-	if ( rc ) {
-		printlog( 1, "%s connection failed", host );
-		return(0);				/* Assume correct time */
+/* Round trip time, jitter and offset of a web server.
+   The Date: of a web server rolls over to the next second at a fixed
+   phase of our second: samples before it have offset k, from it on
+   k+1. When the samples catch the rollover, the offset is known to
+   better than a second, k + 1 - phase.
+*/
+static void surveystats( struct survey *s ) {
+	long				offsets[SURVEY_SAMPLES];
+	long				k = LONG_MAX, lo = -1, hi = 1000000;
+	double				sum = 0, dev = 0;
+	int					i, n = 0, spread = 0;
+
+	for ( i = 0; i < SURVEY_SAMPLES; i++ ) {
+		if ( s->status[i] != HTP_OK )
+			continue;
+		offsets[n++] = s->offsets[i];
+		sum += s->rtts[i];
+		if ( s->offsets[i] < k )
+			k = s->offsets[i];
 	}
 
-	/* Initialize timer */
-	gettimeofday(&timeofday, NULL);
+	s->nsamples = n;
+	if ( n == 0 ) {
+		for ( i = 0; i < SURVEY_SAMPLES && s->status[i] == HTP_OK; i++ );
+		s->error = i < SURVEY_SAMPLES ? s->status[i] : HTP_ERR_TIMEOUT;
+		return;
+	}
 
-	/* Initialize RTT (start of measurement) */
-	rtt = timeofday.tv_sec;
+	s->rtt = sum / n;
+	for ( i = 0; i < SURVEY_SAMPLES; i++ ) {
+		if ( s->status[i] != HTP_OK )
+			continue;
+		dev += ( s->rtts[i] - s->rtt ) * ( s->rtts[i] - s->rtt );
+		if ( s->offsets[i] == k && s->phases[i] > lo )
+			lo = s->phases[i];
+		else if ( s->offsets[i] == k + 1 && s->phases[i] < hi )
+			hi = s->phases[i];
+		else if ( s->offsets[i] > k + 1 )
+			spread = 1;
+	}
+	s->jitter = sqrt( dev / n );
 
-	/* Wait till we reach the desired time, "when" */
-	sleepspec.tv_sec = 0;
-	if ( when >= timeofday.tv_usec ) {
-		sleepspec.tv_nsec = ( when - timeofday.tv_usec ) * 1000;
+	if ( !spread && lo >= 0 && hi < 1000000 && lo < hi ) {
+		s->phase = ( lo + hi ) / 2;
+		s->offset = k + 1 - s->phase * 1e-6;
 	} else {
-		sleepspec.tv_nsec = ( 1000000 + when - timeofday.tv_usec ) * 1000;
-		rtt++;
+		qsort( offsets, n, sizeof(offsets[0]), compare_long );
+		s->offset = offsets[n/2];
 	}
-	nanosleep( &sleepspec, &remainder );
+}
 
-	/* Send HEAD request */
-	if ( send(server_s, buffer, strlen(buffer), 0) < 0 )
-		printlog( 1, "Error sending" );
 
-	/* Receive data from the web server
-	   The return code from recv() is the number of bytes received
-	*/
-	if ( recv(server_s, buffer, BUFFERSIZE - 1, 0) != -1 ) {
+/* Good web servers by round trip time, then the false tickers and
+   last the ones that failed
+*/
+static int compare_survey( const void *a, const void *b ) {
+	const struct survey	*s = a, *t = b;
+	int					rs = s->error ? 2 : s->falseticker;
+	int					rt = t->error ? 2 : t->falseticker;
+
+	if ( rs != rt )
+		return( rs - rt );
+	if ( rs == 0 && s->rtt != t->rtt )
+		return( s->rtt < t->rtt ? -1 : 1 );
+	return( strcmp( s->url, t->url ) );
+}
 
-		/* Assuming that network delay (server->htpdate) is neglectable,
-		   the received web server time "should" match the local time.
 
-		   From RFC 2616 paragraph 14.18
-		   ...
-		   It SHOULD represent the best available approximation
-		   of the date and time of message generation, unless the
-		   implementation has no means of generating a reasonably
-		   accurate date and time.
-		   ...
-		*/
+/* A JSON string, with quotes and backslashes escaped */
+static void jsonstring( const char *s ) {
+	putchar( '"' );
+	for ( ; *s; s++ ) {
+		if ( *s == '"' || *s == '\\' )
+			printf( "\\%c", *s );
+		else if ( (unsigned char)*s < 0x20 )
+			printf( "\\u%04x", *s );
+		else
+			putchar( *s );
+	}
+	putchar( '"' );
+}
 
-		gettimeofday(&timeofday, NULL);
 
-		/* rtt contains round trip time in micro seconds, now! */
-		rtt = ( timeofday.tv_sec - rtt ) * 1000000 + \
-			timeofday.tv_usec - when;
+/* A CSV field, quoted if it has to be (RFC 4180) */
+static void csvfield( const char *s ) {
+	if ( strpbrk( s, ",\"\r\n" ) == NULL ) {
+		fputs( s, stdout );
+		return;
+	}
 
-		/* Look for the line that contains Date: */
-		if ( (pdate = strstr(buffer, "Date: ")) != NULL && strlen( pdate ) >= 35 ) {
-			strncpy(remote_time, pdate + 11, 24);
+	putchar( '"' );
+	for ( ; *s; s++ ) {
+		if ( *s == '"' )
+			putchar( '"' );
+		putchar( *s );
+	}
+	putchar( '"' );
+}
 
-			if ( strptime( remote_time, "%d %b %Y %T", &tm) != NULL) {
-				timevalue.tv_sec = gmtmktime(&tm);
-			} else {
-				printlog( 1, "%s unknown time format", host );
-			}
 
-			/* Print host, raw timestamp, round trip time */
-			if ( debug )
-				printlog( 0, "%-25s %s %s (%.3f) => %li", host, port, remote_time, \
-				  rtt * 1e-6, timevalue.tv_sec - timeofday.tv_sec );
+static void surveyreport( struct survey *servers, int n, int json ) {
+	struct survey		*s;
+	const char			*status;
+	char				phase[16], http[8];
+	int					i;
 
+	if ( json )
+		puts( "[" );
+	else
+		puts( "host,port,status,samples,offset_s,rtt_ms,jitter_ms,phase_ms,http,keepalive" );
+
+	for ( i = 0; i < n; i++ ) {
+		s = &servers[i];
+		status = s->error ? htp_strerror( s->error ) : \
+			s->falseticker ? "false ticker" : "ok";
+
+		if ( json ) {
+			fputs( "  { \"host\": ", stdout );
+			jsonstring( s->host );
+			fputs( ", \"port\": ", stdout );
+			jsonstring( s->port );
+			fputs( ", \"status\": ", stdout );
+			jsonstring( status );
+			printf( ", \"samples\": %d", s->nsamples );
+			if ( s->nsamples ) {
+				snprintf( phase, sizeof(phase), "%.1f", s->phase * 1e-3 );
+				snprintf( http, sizeof(http), "\"1.%d\"", s->httpversion % 10 );
+				printf( ", \"offset\": %.3f, \"rtt\": %.3f, \"jitter\": %.3f, \"phase\": %s, \"http\": %s, \"keepalive\": %s", \
+					s->offset, s->rtt * 1e-3, s->jitter * 1e-3, \
+					s->phase < 0 ? "null" : phase, \
+					s->httpversion ? http : "null", \
+					s->keepalive ? "true" : "false" );
+			}
+			printf( " }%s\n", i < n - 1 ? "," : "" );
+			continue;
+		}
+
+		csvfield( s->host );
+		putchar( ',' );
+		csvfield( s->port );
+		printf( ",%s,%d", status, s->nsamples );
+		if ( s->nsamples ) {
+			printf( ",%.3f,%.3f,%.3f,", s->offset, s->rtt * 1e-3, \
+				s->jitter * 1e-3 );
+			if ( s->phase >= 0 )
+				printf( "%.1f", s->phase * 1e-3 );
+			if ( s->httpversion )
+				printf( ",1.%d", s->httpversion % 10 );
+			else
+				printf( "," );
+			printf( ",%s\n", s->keepalive ? "yes" : "no" );
 		} else {
-			printlog( 1, "%s no timestamp", host );
+			printf( ",,,,,,\n" );
 		}
+	}
+
+	if ( json )
+		puts( "]" );
+}
 
-	}						/* bytes received */
 
-	close( server_s );
+/* Take the trace events of a survey, they are written after it: no
+   formatting or writing between the polls
+*/
+static void keeptrace( struct htp_ctx *ctx, struct htp_event **events, long *nevents, long *maxevents ) {
+	struct htp_event	*more;
+	int					n;
 
-	/* Return the time delta between web server time (timevalue)
-	   and system time (timeofday)
-	*/
-	return( timevalue.tv_sec - timeofday.tv_sec );
-			
+	do {
+		if ( *nevents == *maxevents ) {
+			*maxevents = *maxevents ? *maxevents * 2 : SURVEY_TRACE_EVENTS;
+			if ( (more = realloc( *events, *maxevents * sizeof(**events) )) == NULL ) {
+				printlog( 1, "Out of memory" );
+				exit(1);
+			}
+			*events = more;
+		}
+		n = htp_trace( ctx, *events + *nevents, *maxevents - *nevents );
+		*nevents += n;
+	} while ( n > 0 && *nevents == *maxevents );
+}
+
+
+static void survey( struct htp_ctx *ctx, char *file, int budget, int rate, int json ) {
+	struct survey		*servers, *s;
+	struct surveypoll	*polls = NULL, *byid = NULL, *more, *sp;
+	struct htp_result	result;
+	struct pollfd		*pfds = NULL, *morefds;
+	struct htp_event	*events = NULL;
+	struct rlimit		rl;
+	struct timeval		tv;
+	long long			now, last;
+	double				tokens = 1;
+	long				*offsets, median, nevents = 0, maxevents = 0, e;
+	int					nservers, npolls = 0, maxpolls = 0, next = 0;
+	int					nbyid = 0, pending = 0, timeout, wait;
+	int					nfds, maxfds = 0, i, id, sample;
+
+	servers = surveyread( file, &nservers );
+
+	/* Every poll needs a socket, some more during the connection race */
+	if ( getrlimit( RLIMIT_NOFILE, &rl ) == 0 ) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit( RLIMIT_NOFILE, &rl );
+		getrlimit( RLIMIT_NOFILE, &rl );
+		if ( rl.rlim_cur != RLIM_INFINITY && \
+		  (rlim_t)budget * 2 + 32 > rl.rlim_cur ) {
+			budget = rl.rlim_cur > 64 ? ( rl.rlim_cur - 32 ) / 2 : 16;
+			printlog( 1, "Too few file descriptors, %d connections", budget );
+		}
+	}
+
+	/* First poll of every web server, spread over the second */
+	maxpolls = nservers * SURVEY_SAMPLES;
+	if ( nservers && (polls = malloc( maxpolls * sizeof(*polls) )) == NULL ) {
+		printlog( 1, "Out of memory" );
+		exit(1);
+	}
+	for ( i = 0; i < nservers; i++ ) {
+		servers[i].when = (long)i * 7919 % (1000000 / SURVEY_SAMPLES);
+		servers[i].left = SURVEY_SAMPLES;
+		polls[npolls].server = i;
+		polls[npolls].sample = 0;
+		polls[npolls].count = SURVEY_SAMPLES;
+		polls[npolls++].when = servers[i].when;
+	}
+
+	gettimeofday( &tv, NULL );
+	last = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	while ( next < npolls || pending ) {
+		/* Start new polls within the connection budget and rate */
+		gettimeofday( &tv, NULL );
+		now = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+		tokens += ( now - last ) * 1e-6 * rate;
+		if ( tokens > rate )
+			tokens = rate;
+		last = now;
+
+		while ( next < npolls && pending < budget && tokens >= 1 ) {
+			sp = &polls[next++];
+			s = &servers[sp->server];
+			id = htp_submit( ctx, s->url, sp->when, sp->count, \
+				1000000 + 1000000 / SURVEY_SAMPLES );
+			tokens--;
+			if ( id < 0 ) {
+				for ( i = 0; i < sp->count; i++ )
+					s->status[sp->sample + i] = HTP_ERR_RESOLVE;
+				s->left -= sp->count;
+				continue;
+			}
+			if ( id >= nbyid ) {
+				nbyid = id * 2 + 256;
+				if ( (more = realloc( byid, nbyid * sizeof(*byid) )) == NULL ) {
+					printlog( 1, "Out of memory" );
+					exit(1);
+				}
+				byid = more;
+			}
+			byid[id] = *sp;
+			pending++;
+		}
+
+		pending = htp_process( ctx );
+		if ( tracefile )
+			keeptrace( ctx, &events, &nevents, &maxevents );
+
+		while ( htp_result( ctx, &result ) ) {
+			sp = &byid[result.id];
+			s = &servers[sp->server];
+			sample = sp->sample + result.sample;
+			s->left--;
+			s->status[sample] = result.status;
+			strcpy( s->host, result.host );
+			strcpy( s->port, result.port );
+
+			if ( result.status == HTP_OK ) {
+				s->offsets[sample] = result.offset;
+				s->rtts[sample] = result.rtt;
+				s->phases[sample] = ( result.received - result.rtt / 2 ) % 1000000;
+				if ( s->httpversion == 0 ) {
+					s->httpversion = result.httpversion;
+					s->keepalive = result.keepalive;
+				}
+			}
+
+			/* The connection wasn't kept alive, poll the rest one by one */
+			if ( s->left || s->retried || s->status[0] != HTP_OK )
+				continue;
+			s->retried = 1;
+			for ( i = 1; i < SURVEY_SAMPLES; i++ ) {
+				if ( s->status[i] == HTP_OK )
+					continue;
+				s->keepalive = 0;
+				s->left++;
+				polls[npolls].server = sp->server;
+				polls[npolls].sample = i;
+				polls[npolls].count = 1;
+				polls[npolls++].when = s->when + i * (1000000 / SURVEY_SAMPLES);
+			}
+		}
+
+		/* Wait for the next event, or the next poll to start */
+		timeout = -1;
+		if ( next < npolls && pending < budget )
+			timeout = tokens >= 1 ? 0 : (int)( ( 1 - tokens ) * 1000 / rate ) + 1;
+		if ( pending && (wait = htp_timeout( ctx )) >= 0 && \
+		  ( timeout < 0 || wait < timeout ) )
+			timeout = wait;
+		if ( !pending && timeout < 0 )
+			continue;
+
+		while ( (nfds = htp_pollfds( ctx, pfds, maxfds )) > maxfds ) {
+			maxfds = nfds * 2;
+			if ( (morefds = realloc( pfds, maxfds * sizeof(*pfds) )) == NULL ) {
+				printlog( 1, "Out of memory" );
+				exit(1);
+			}
+			pfds = morefds;
+		}
+		poll( pfds, nfds, timeout );
+	}
+	free( pfds );
+
+	/* The trace, with the web server of a poll before its first event */
+	if ( tracefile ) {
+		keeptrace( ctx, &events, &nevents, &maxevents );
+		for ( e = 0; e < nevents; e++ ) {
+			if ( events[e].type == HTP_EV_SUBMIT )
+				fprintf( tracefile, "# %d %s\n", events[e].id, \
+					servers[byid[events[e].id].server].url );
+			writetrace( &events[e] );
+		}
+		fflush( tracefile );
+		free( events );
+	}
+
+	/* A web server more than a second off from the median is a false ticker */
+	offsets = malloc( ( nservers + 1 ) * sizeof(*offsets) );
+	for ( i = 0, id = 0; i < nservers; i++ ) {
+		surveystats( &servers[i] );
+		if ( offsets && !servers[i].error )
+			offsets[id++] = lround( servers[i].offset * 1000 );
+	}
+	if ( offsets && id ) {
+		qsort( offsets, id, sizeof(offsets[0]), compare_long );
+		median = offsets[id/2];
+		for ( i = 0; i < nservers; i++ ) {
+			if ( !servers[i].error && \
+			  labs( lround( servers[i].offset * 1000 ) - median ) > 1000 )
+				servers[i].falseticker = 1;
+		}
+	}
+	free( offsets );
+
+	qsort( servers, nservers, sizeof(*servers), compare_survey );
+	flushlog();
+	surveyreport( servers, nservers, json );
+
+	for ( i = 0; i < nservers; i++ )
+		free( servers[i].url );
+	free( servers );
+	free( polls );
+	free( byid );
 }
 
 
@@ -413,30 +1031,42 @@ static int htpdate_adjtimex( double drift ) {
 
 static void showhelp() {
 	puts("htpdate version "VERSION"\n\
-Usage: htpdate [-046abdhlqstxD] [-i pid file] [-m minpoll] [-M maxpoll]\n\
-         [-p precision] [-P <proxyserver>[:port]] [-u user[:group]]\n\
-         <host[:port]> ...\n\n\
+Usage: htpdate [-046abdhklqstxDTU] [-e trace file] [-f state file] [-i pid file]\n\
+         [-m minpoll] [-M maxpoll] [-p precision] [-P <proxyserver>[:port]]\n\
+         [-u user[:group]]\n\
+         <[https://]host[:port]> ...\n\
+       htpdate -S <host file> [-046djTU] [-c connections] [-r rate]\n\
+         [-e trace file] [-P <proxyserver>[:port]]\n\n\
   -0    HTTP/1.0 request\n\
   -4    Force IPv4 name resolution only\n\
   -6    Force IPv6 name resolution only\n\
   -a    adjust time smoothly\n\
   -b    burst mode\n\
+  -c    survey: concurrent connections (default 256)\n\
   -d    debug mode\n\
   -D    daemon mode\n\
+  -e    write the events of all polls to trace file\n\
+  -f    keep the quality of the web servers in state file\n\
   -h    help\n\
   -i    pid file\n\
+  -j    survey: report in JSON instead of CSV\n\
+  -k    pipelined burst mode (keep-alive)\n\
   -l    use syslog for output\n\
   -m    minimum poll interval\n\
   -M    maximum poll interval\n\
   -p    precision (ms)\n\
   -P    proxy server\n\
   -q    query only, don't make time changes (default)\n\
+  -r    survey: new connections per second (default 100)\n\
   -s    set time\n\
+  -S    survey the web servers in host file (- for stdin)\n\
   -t    turn off sanity time check\n\
+  -T    tunnel through proxy server (CONNECT)\n\
+  -U    poll with io_uring (Linux, \"make uring\")\n\
   -u    run daemon as user\n\
   -x    adjust kernel clock\n\
   host  web server hostname or ip address (maximum of 16)\n\
-  port  port number (default 80 and 8080 for proxy server)\n");
+  port  port number (default 80, 443 for https and 8080 for proxy server)\n");
 
 	return;
 }
@@ -509,18 +1139,27 @@ static void runasdaemon( char *pidfile ) {
 
 
 int main( int argc, char *argv[] ) {
-	char				*host = NULL, *proxy = NULL, *proxyport = NULL;
-	char				*port = NULL;
-	char				*hostport = NULL;
+	char				*proxy = NULL;
+	char				*statefile = NULL;
 	char				*httpversion = DEFAULT_HTTP_VERSION;
 	char				*pidfile = DEFAULT_PID_FILE;
 	char				*user = NULL, *userstr = NULL, *group = NULL;
 	long long			sumtimes;
 	double				timeavg, drift = 0;
-	int					timedelta[(MAX_HTTP_HOSTS+1)*(MAX_HTTP_HOSTS+1)-1], timestamp;
+	int					timedelta[(MAX_HTTP_HOSTS+1)*(MAX_HTTP_HOSTS+1)-1];
+	int					deltas[(MAX_HTTP_HOSTS+1)*(MAX_HTTP_HOSTS+1)-1];
+	int					from[(MAX_HTTP_HOSTS+1)*(MAX_HTTP_HOSTS+1)-1];
+	struct source		sources[MAX_HTTP_HOSTS+1], *source;
+	int					order[MAX_HTTP_HOSTS+1], npolled;
+	long				timestamp;
 	int                 numservers, validtimes, goodtimes, mean;
 	int					nap = 0, when = 500000, precision = 0;
 	int					setmode = 0, burstmode = 0, try, offsetdetect;
+	int					pipeline = 0, npipelined, tunnel = 0, uring = 0;
+	char				*surveyfile = NULL;
+	int					budget = DEFAULT_SURVEY_BUDGET, json = 0;
+	int					rate = DEFAULT_SURVEY_RATE;
+	long				pipelined[MAX_HTTP_HOSTS+1];
 	int					i, burst, param;
 	int					daemonize = 0;
 	int					ipversion = DEFAULT_IP_VERSION;
@@ -533,13 +1172,15 @@ int main( int argc, char *argv[] ) {
 
 	struct passwd		*pw;
 	struct group		*gr;
+	struct htp_options	options;
+	struct htp_ctx		*ctx;
 
 	extern char			*optarg;
 	extern int			optind;
 
 
 	/* Parse the command line switches and arguments */
-	while ( (param = getopt(argc, argv, "046abdhi:lm:p:qstu:xDM:P:") ) != -1)
+	while ( (param = getopt(argc, argv, "046abc:de:f:hi:jklm:p:qr:stu:xDM:P:S:TU") ) != -1)
 	switch( param ) {
 
 		case '0':			/* HTTP/1.0 */
@@ -554,18 +1195,41 @@ int main( int argc, char *argv[] ) {
 		case 'a':			/* adjust time */
 			setmode = 1;
 			break;
+		case 'c':			/* survey connection budget */
+			if ( ( budget = atoi(optarg) ) <= 0 ) {
+				fputs( "Invalid number of connections\n", stderr );
+				exit(1);
+			}
+			break;
 		case 'b':			/* burst mode */
 			burstmode = 1;
 			break;
 		case 'd':			/* turn debug on */
 			debug = 1;
 			break;
+		case 'e':			/* trace file */
+			if ( (tracefile = fopen( optarg, "w" )) == NULL ) {
+				printlog( 1, "%s", optarg );
+				exit(1);
+			}
+			fputs( "# time id sample event value\n", tracefile );
+			break;
+		case 'f':			/* state file */
+			statefile = (char *)optarg;
+			break;
 		case 'h':			/* show help */
 			showhelp();
 			exit(0);
 		case 'i':			/* pid file */
 			pidfile = (char *)optarg;
 			break;
+		case 'j':			/* survey report in JSON */
+			json = 1;
+			break;
+		case 'k':			/* pipelined burst mode */
+			burstmode = 1;
+			pipeline = 1;
+			break;
 		case 'l':			/* log mode */
 			logmode = 1;
 			break;
@@ -586,6 +1250,12 @@ int main( int argc, char *argv[] ) {
 			break;
 		case 'q':			/* query only */
 			break;
+		case 'r':			/* survey connection rate */
+			if ( ( rate = atoi(optarg) ) <= 0 ) {
+				fputs( "Invalid rate\n", stderr );
+				exit(1);
+			}
+			break;
 		case 's':			/* set time */
 			setmode = 2;
 			break;
@@ -630,8 +1300,15 @@ int main( int argc, char *argv[] ) {
 			break;
 		case 'P':
 			proxy = (char *)optarg;
-			proxyport = DEFAULT_PROXY_PORT;
-			splithostport( &proxy, &proxyport );
+			break;
+		case 'S':			/* survey mode */
+			surveyfile = (char *)optarg;
+			break;
+		case 'T':			/* tunnel through proxy server */
+			tunnel = 1;
+			break;
+		case 'U':			/* poll with io_uring */
+			uring = 1;
 			break;
 		case '?':
 			return 1;
@@ -640,7 +1317,7 @@ int main( int argc, char *argv[] ) {
 	}
 
 	/* Display help page, if no servers are specified */
-	if ( argv[optind] == NULL ) {
+	if ( argv[optind] == NULL && surveyfile == NULL ) {
 		showhelp();
 		exit(1);
 	}
@@ -652,14 +1329,24 @@ int main( int argc, char *argv[] ) {
 		exit(1);
 	}
 
+#ifndef ENABLE_HTTPS
+	/* HTTPS time sources need TLS support */
+	for ( i = optind; i < argc; i++ ) {
+		if ( strncmp( argv[i], "https://", 8 ) == 0 ) {
+			fputs( "HTTPS not supported, build with \"make https\"\n", stderr );
+			exit(1);
+		}
+	}
+#endif
+
 	/* One must be "root" to change the system time */
-	if ( (getuid() != 0) && (setmode || daemonize) ) {
+	if ( (getuid() != 0) && (setmode || daemonize) && surveyfile == NULL ) {
 		fputs( "Only root can change time\n", stderr );
 		exit(1);
 	}
 
 	/* Run as a daemonize when -D is set */
-	if ( daemonize ) {
+	if ( daemonize && surveyfile == NULL ) {
 		runasdaemon( pidfile );
 		/* Query only mode doesn't exist in daemon mode */
 		if ( !setmode )
@@ -670,6 +1357,51 @@ int main( int argc, char *argv[] ) {
 	if ( sw_gid ) swgid( sw_gid );
 	if ( sw_uid ) swuid( sw_uid );
 
+	memset( &options, 0, sizeof(options) );
+	options.ipversion = ipversion;
+	options.httpversion = httpversion;
+	options.proxy = proxy;
+	options.tunnel = tunnel;
+	/* Many web servers at once are better off with epoll */
+	if ( uring )
+		options.backend = HTP_BACKEND_URING;
+	else if ( surveyfile )
+		options.backend = HTP_BACKEND_EPOLL;
+	options.log = logmessage;
+
+	/* Debug output comes from the trace buffer, after the polls, the
+	   library is not to print while measuring
+	*/
+	if ( tracefile || ( debug && surveyfile == NULL ) )
+		options.trace = surveyfile ? SURVEY_TRACE_EVENTS : TRACE_EVENTS;
+
+	/* The survey report goes to stdout, the errors of thousands of
+	   web servers only in debug mode
+	*/
+	if ( surveyfile && !debug )
+		options.log = NULL;
+
+	ctx = htp_new( &options );
+	flushlog();
+	if ( ctx == NULL ) {
+		printlog( 1, "htp_new()" );
+		exit(1);
+	}
+
+	if ( surveyfile ) {
+		survey( ctx, surveyfile, budget, rate, json );
+		showdropped( ctx );
+		htp_free( ctx );
+		exit(0);
+	}
+
+	/* What we know about the web servers from the previous runs */
+	memset( sources, 0, sizeof(sources) );
+	for ( i = 0; i < numservers; i++ )
+		sources[i].url = argv[optind + i];
+	if ( statefile )
+		stateread( statefile, sources, numservers );
+
 	/* In case we have more than one web server defined, we
 	   spread the polls equal within a second and take a "nap" in between
 	*/
@@ -689,20 +1421,26 @@ int main( int argc, char *argv[] ) {
 	/* Initialize number of received valid timestamps, good timestamps
 	   and the average of the good timestamps
 	*/
-	validtimes = goodtimes = sumtimes = offsetdetect = 0;
+	validtimes = offsetdetect = 0;
 	if ( precision )
 		when = precision;
 	else
 		when = nap;
 
+	/* The best web servers first, skip the bad ones for a while */
+	if ( statefile ) {
+		npolled = stateorder( sources, numservers, order );
+	} else {
+		for ( i = 0; i < numservers; i++ )
+			order[i] = i;
+		npolled = numservers;
+	}
+
 	/* Loop through the time sources (web servers); poll cycle */
-	for ( i = optind; i < argc; i++ ) {
+	for ( i = 0; i < npolled; i++ ) {
 
-		/* host:port is stored in argv[i] */
-		hostport = (char *)argv[i];
-		host = strdup(hostport);
-		port = DEFAULT_HTTP_PORT;
-		splithostport( &host, &port );
+		/* [scheme://]host:port is stored in source->url */
+		source = &sources[order[i]];
 
 		/* if burst mode, reset "when" */
 		if ( burstmode ) {
@@ -712,21 +1450,34 @@ int main( int argc, char *argv[] ) {
 				when = nap;
 		}
 
+		/* Pipelined burst, all samples on one keep-alive connection */
+		npipelined = 0;
+		if ( burstmode && pipeline ) {
+			if ( debug ) deferlog( 0, "pipeline: %d when: %d", \
+				numservers, when );
+			npipelined = getHTTPdate( ctx, source, when, nap, \
+				numservers, pipelined );
+		}
+
 		burst = 0;
 		do {
-			/* Retry if first poll shows time offset */
-			try = MAX_ATTEMPT;
-			do {
-				if ( debug ) printlog( 0, "burst: %d try: %d when: %d", \
-					burst + 1, MAX_ATTEMPT - try + 1, when );
-				timestamp = getHTTPdate( host, port, proxy, proxyport,\
-						httpversion, ipversion, when );
-				try--;
-			} while ( timestamp && try );
+			if ( burst < npipelined ) {
+				timestamp = pipelined[burst];
+			} else {
+				/* Retry if first poll shows time offset */
+				try = MAX_ATTEMPT;
+				do {
+					if ( debug ) deferlog( 0, "burst: %d try: %d when: %d", \
+						burst + 1, MAX_ATTEMPT - try + 1, when );
+					getHTTPdate( ctx, source, when, 0, 1, &timestamp );
+					try--;
+				} while ( timestamp && try );
+			}
 
 			/* Only include valid responses in timedelta[] */
 			if ( timestamp < timelimit && timestamp > -timelimit ) {
 				timedelta[validtimes] = timestamp;
+				from[validtimes] = order[i];
 				validtimes++;
 			}
 
@@ -750,32 +1501,33 @@ int main( int argc, char *argv[] ) {
 		} while ( burst < (argc - optind) * burstmode );
 
 		/* Sleep for a while, unless we detected a time offset */
-		if ( daemonize && !offsetdetect )
+		if ( daemonize && !offsetdetect ) {
+			flushlog();
 			sleep( sleeptime / numservers );
+		}
 
 	}
 
-	/* Sort the timedelta results */
-	insertsort( timedelta, validtimes );
+	/* The poll cycle is done */
+	flushlog();
 
-	/* Mean time value */
-	mean = timedelta[validtimes/2];
+	/* Filter out the bogus timevalues, 'false tickers' */
+	memcpy( deltas, timedelta, validtimes * sizeof(int) );
+	goodtimes = htp_select( timedelta, validtimes, &mean, &sumtimes );
 
-	/* Filter out the bogus timevalues. A timedelta which is more than
-	   1 seconde off from mean, is considered a 'false ticker'.
-	   NTP synced web servers can never be more off than a second.
-	*/
-	for ( i = 0; i < validtimes; i++ ) {
-		if ( timedelta[i]-mean <= 1 && timedelta[i]-mean >= -1 ) {
-			sumtimes += timedelta[i];
-			goodtimes++;
-		}
+	if ( statefile ) {
+		statecycle( sources, order, npolled, deltas, from, validtimes, \
+			goodtimes, mean, minsleep, maxsleep );
+		statewrite( statefile, sources, numservers );
 	}
 
 	/* Check if we have at least one valid response */
 	if ( goodtimes ) {
 
 		timeavg = sumtimes/(double)goodtimes;
+		if ( statefile )
+			timeavg = stateaverage( sources, deltas, from, validtimes, \
+				mean, timeavg );
 
 		if ( debug ) {
 			printlog( 0, "#: %d mean: %d average: %.3f", goodtimes, \
@@ -848,6 +1600,8 @@ int main( int argc, char *argv[] ) {
 
 	} while ( daemonize );		/* end of infinite while loop */
 
+	showdropped( ctx );
+	htp_free( ctx );
 	exit(0);
 }
 
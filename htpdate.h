@@ -0,0 +1,172 @@
+/*
+	libhtpdate
+
+	Eddy Vervest <eddy@vervest.org>
+	http://www.vervest.org/htp
+
+	Query the time offset against web servers, as used by htpdate(8)
+
+	A context (struct htp_ctx) holds all state, there are no globals,
+	so a program can use as many contexts as it likes, one per thread.
+	Web servers are submitted with htp_submit() and polled in the
+	background: poll(2) the file descriptors of htp_pollfds() for at most
+	htp_timeout(), call htp_process() and collect the samples with
+	htp_result(). Name resolution, connecting and receiving never block.
+	On Linux the epoll backend waits on the single htp_fd() instead.
+
+	Example:
+
+	struct htp_ctx		*ctx = htp_new( NULL );
+	struct htp_result	result;
+
+	htp_submit( ctx, "https://www.linux.org", 500000, 1, 0 );
+	htp_wait( ctx );
+	while ( htp_result( ctx, &result ) )
+		printf( "%s %ld\n", result.host, result.offset );
+	htp_free( ctx );
+
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+	http://www.gnu.org/copyleft/gpl.html
+*/
+
+#ifndef HTPDATE_H
+#define HTPDATE_H
+
+#include <poll.h>
+
+#define HTPDATE_VERSION			"1.2.0"
+#define	HTP_MAX_SAMPLES			16				/* Samples per htp_submit() */
+#define	HTP_HOSTSIZE			128
+
+/* Sample status, negative values are errors */
+#define	HTP_OK					0
+#define	HTP_ERR_RESOLVE			-1				/* Host or service unavailable */
+#define	HTP_ERR_CONNECT			-2				/* Connection failed */
+#define	HTP_ERR_TUNNEL			-3				/* Proxy server refused tunnel */
+#define	HTP_ERR_TLS				-4				/* TLS handshake failed */
+#define	HTP_ERR_SEND			-5				/* Error sending request */
+#define	HTP_ERR_RECV			-6				/* No response */
+#define	HTP_ERR_DATE			-7				/* No or unknown timestamp */
+#define	HTP_ERR_TIMEOUT			-8				/* No response in time */
+
+/* Backends, falling back to the next one down if not available */
+#define	HTP_BACKEND_POLL		0				/* poll(2), portable */
+#define	HTP_BACKEND_EPOLL		1				/* epoll(7) and timerfd, Linux */
+#define	HTP_BACKEND_URING		2				/* Plain HTTP on io_uring, Linux */
+
+struct htp_ctx;
+
+struct htp_options {
+	int			ipversion;		/* 4 or 6 only, 0 for both */
+	const char	*httpversion;	/* "0" for HTTP/1.0, "1" for HTTP/1.1 */
+	const char	*proxy;			/* Proxy server host[:port], NULL for none */
+	int			tunnel;			/* Tunnel through the proxy server (CONNECT) */
+	int			backend;		/* HTP_BACKEND_..., 0 (poll) by default */
+	int			trace;			/* Trace events kept for htp_trace(), 0 for none */
+
+	/* Messages of the library, not called if NULL. The errors of a poll
+	   are logged when it is done, use the trace for debugging.
+	*/
+	void		(*log)( void *arg, int is_error, const char *message );
+	void		*logarg;
+};
+
+struct htp_result {
+	int			id;				/* As returned by htp_submit() */
+	int			sample;			/* 0 .. count-1 */
+	int			status;			/* HTP_OK or HTP_ERR_... */
+	char		host[HTP_HOSTSIZE];
+	char		port[8];
+	long		offset;			/* Web server time - local time, seconds */
+	long		rtt;			/* Round trip time, microseconds */
+	long long	received;		/* Local time of the response, microseconds */
+	int			httpversion;	/* Of the response, 10 or 11; 0 if unknown */
+	int			keepalive;		/* Web server keeps the connection alive */
+};
+
+/* Trace event types */
+#define	HTP_EV_SUBMIT			0				/* Poll submitted */
+#define	HTP_EV_RESOLVE			1				/* Name resolved */
+#define	HTP_EV_CONNECT			2				/* Connected, value: address family,
+												   0 for a kept proxy connection */
+#define	HTP_EV_TUNNEL			3				/* Tunnel through proxy server open */
+#define	HTP_EV_TLS				4				/* TLS handshake done, value: TLS
+												   version << 1 | 1 if resumed */
+#define	HTP_EV_SEND				5				/* Request sent */
+#define	HTP_EV_FIRSTBYTE		6				/* Response started */
+#define	HTP_EV_DATE				7				/* Date: parsed, value: offset */
+#define	HTP_EV_DONE				8				/* Poll done, value: status */
+
+/* Fixed size, so recording one is a few stores on the measurement path */
+struct htp_event {
+	long long	time;			/* Local time, microseconds */
+	long long	value;
+	int			id;				/* As returned by htp_submit() */
+	short		sample;			/* -1 if not for a sample */
+	short		type;			/* HTP_EV_... */
+};
+
+/* Create a context, options are copied; NULL for the defaults */
+struct htp_ctx *htp_new( const struct htp_options *options );
+void htp_free( struct htp_ctx *ctx );
+
+/* Poll the web server [http[s]://]host[:port], count samples at "when"
+   microseconds past the second and then every nap microseconds.
+   More than one sample is pipelined on one keep-alive connection.
+   Returns an id for the results, or -1 on error.
+*/
+int htp_submit( struct htp_ctx *ctx, const char *url, int when, int count, int nap );
+
+/* Fill fds with up to max file descriptors to poll(2) before the next
+   htp_process(), returns how many there are (more than max if it is
+   too small). The set changes with every htp_process().
+*/
+int htp_pollfds( struct htp_ctx *ctx, struct pollfd *fds, int max );
+
+/* Milliseconds until htp_process() is due without any events, 0 if it
+   is due now, -1 if there is no timed event.
+*/
+int htp_timeout( struct htp_ctx *ctx );
+
+/* Single file descriptor which becomes readable when htp_process() is
+   due, -1 unless the backend is epoll or io_uring
+*/
+int htp_fd( struct htp_ctx *ctx );
+
+/* The backend in use, HTP_BACKEND_..., and its name */
+int htp_backend( struct htp_ctx *ctx );
+const char *htp_backendname( int backend );
+
+/* Advance all polls without blocking, returns the number still pending */
+int htp_process( struct htp_ctx *ctx );
+
+/* Block until all polls are done */
+void htp_wait( struct htp_ctx *ctx );
+
+/* Collect a result, returns 0 if there are none (left) */
+int htp_result( struct htp_ctx *ctx, struct htp_result *result );
+
+/* Take up to max trace events, oldest first, returns the number taken.
+   Events are recorded in a ring buffer of options.trace events, lock
+   free, so one other thread may take them while the context is being
+   processed. When it is full new events are dropped, and counted.
+*/
+int htp_trace( struct htp_ctx *ctx, struct htp_event *events, int max );
+unsigned long htp_trace_dropped( struct htp_ctx *ctx );
+const char *htp_event_name( int type );
+
+/* Description of a sample status */
+const char *htp_strerror( int status );
+
+/* Sort the time deltas, and sum the ones within a second of the mean,
+   the others are 'false tickers'. Returns the number of good time deltas.
+*/
+int htp_select( int timedelta[], int count, int *mean, long long *sum );
+
+#endif
+
+/* vim: set ts=4 sw=4: */
@@ -0,0 +1,2345 @@
+/*
+	libhtpdate v1.2.0
+
+	Eddy Vervest <eddy@vervest.org>
+	http://www.vervest.org/htp
+
+	Measure the time offset against web servers, see htpdate.h
+
+	This library works with the timestamps return by web servers,
+	formatted as specified by HTTP/1.1 (RFC 2616, RFC 1123).
+
+	Every poll is a small state machine, driven by htp_process():
+
+	RESOLVING -> CONNECTING -> [TUNNELING] -> [HANDSHAKING] -> REQUESTING
+
+	All sockets are non-blocking. The portable core waits for them with
+	poll(2), see htp_pollfds() and htp_timeout() for the next timed event
+	(a connection attempt, a request at "when", a time-out). On Linux the
+	sockets can be registered with one epoll instance instead, together
+	with a timerfd, so the whole context can be waited for on a single
+	file descriptor. Plain HTTP polls can go through io_uring on top.
+
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+	http://www.gnu.org/copyleft/gpl.html
+*/
+
+/* Needed for strptime, timegm and strcasestr */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#ifdef ENABLE_HTTPS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+#ifdef __linux__
+#define	HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#if defined(ENABLE_IO_URING) && !defined(HAVE_EPOLL)
+#undef ENABLE_IO_URING
+#endif
+#ifdef ENABLE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "htpdate.h"
+
+#define	DEFAULT_HTTP_PORT		"80"
+#define	DEFAULT_HTTPS_PORT		"443"
+#define	DEFAULT_PROXY_PORT		"8080"
+#define	DEFAULT_HTTP_VERSION	"1"				/* HTTP/1.1 */
+#define	URLSIZE					HTP_HOSTSIZE
+#define	KEYSIZE					320				/* Proxy connection pool key */
+#define	BUFFERSIZE				1024
+#define	MAX_ADDRS				16				/* Connection race entries */
+#define	MAX_EVENTS				64				/* Per epoll_wait() */
+#define	MAX_POLLFDS				64				/* Initial poll(2) set */
+#define	POOLSIZE				16				/* Kept proxy connections */
+#define	CONNECTION_ATTEMPT_DELAY	250000		/* us, RFC 8305 */
+#define	CONNECT_TIMEOUT			10000000		/* us */
+#define	RESPONSE_TIMEOUT		10000000		/* us */
+#define	URING_ENTRIES			256				/* Submission queue size */
+
+/* Poll states */
+#define	RESOLVING				0
+#define	CONNECTING				1
+#define	TUNNELING				2
+#define	HANDSHAKING				3
+#define	REQUESTING				4
+#define	URING					5				/* Chained on the io_uring */
+#define	DONE					6
+
+/* io_uring operations, in the low bits of the user data of a poll */
+#define	URING_TIMEOUT			0
+#define	URING_CONNECT			1
+#define	URING_SEND				2
+#define	URING_RECV				3
+#define	URING_CLOSE				4
+#define	URING_OPMASK			7
+
+
+/* State kept between polls: the address family per host, web servers
+   and proxy server, and the TLS session per web server host:port
+*/
+struct hostcache {
+	char		host[URLSIZE + 8];
+	int			family;				/* Winner of the last connection race */
+#ifdef ENABLE_HTTPS
+	SSL_SESSION	*session;			/* TLS session for resumption, host:port */
+#endif
+};
+
+/* Connection to a web server or proxy server */
+struct connection {
+	int			fd;
+	char		pool[KEYSIZE];		/* Pool key, if the connection is kept */
+	long		proxyrtt;			/* Round trip time to the proxy server */
+#ifdef ENABLE_HTTPS
+	SSL			*ssl;
+#endif
+};
+
+/* Names are resolved by getaddrinfo() in a thread per poll, which
+   signals the pipe when done. That thread may run after the poll and
+   the context are gone, so every lookup holds a reference to the
+   resolver, and so does the context.
+*/
+struct resolver {
+	int			fds[2];				/* Pipe, read and write end */
+	int			refs;
+};
+
+struct lookup {
+	struct resolver		*resolver;
+	char				name[URLSIZE];
+	char				service[URLSIZE];
+	struct addrinfo		hints;
+	struct addrinfo		*result;
+	int					error;
+	int					done;
+	int					refs;			/* Poll and thread */
+};
+
+/* Trace events, single producer (htp_process) and single consumer
+   (htp_trace) ring buffer
+*/
+struct trace {
+	struct htp_event	*events;
+	unsigned int		size;			/* Power of 2 */
+	unsigned int		head;			/* Next to take, consumer */
+	unsigned int		tail;			/* Next to record, producer */
+	unsigned long		dropped;
+};
+
+#ifdef ENABLE_IO_URING
+/* Shared submission and completion queues, see io_uring_setup(2) */
+struct uring {
+	int					fd;
+	void				*sq;
+	size_t				sqsize;
+	unsigned int		*sqhead, *sqtail, *sqarray, *sqflags, sqmask;
+	unsigned int		*cqhead, *cqtail, cqmask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	unsigned int		entries;
+	unsigned int		queued;			/* Not submitted yet */
+	unsigned int		inflight;		/* Without a completion yet */
+	int					draining;		/* Everything cancelled, htp_free() */
+};
+#endif
+
+/* A poll of one web server, for one or more (pipelined) samples */
+struct probe {
+	struct probe		*next;
+	int					id;
+	int					state;
+	int					ready;			/* Had a socket event */
+	long long			deadline;		/* Next timed event, us */
+	char				host[URLSIZE];
+	char				port[8];
+	char				key[KEYSIZE];	/* Proxy connection pool key */
+	int					https, tunnel;
+	int					when, nap, count;
+
+	/* Name resolution */
+	char				*name;			/* Web server or proxy server */
+	struct lookup		*lookup;
+	struct addrinfo		*addrinfo;
+
+	/* Connection race, Happy Eyeballs */
+	struct addrinfo		*addrs[MAX_ADDRS];
+	int					fds[MAX_ADDRS];
+	long long			started[MAX_ADDRS];
+	int					naddrs, nstarted, active;
+	long long			connstart, attempt;
+
+	struct connection	conn;
+	unsigned int		events;			/* Of conn.fd, POLLIN and POLLOUT */
+	char				error[128];		/* Logged when the poll is done */
+
+	/* Requests and responses */
+	long long			start;			/* First request is due */
+	long long			sent[HTP_MAX_SAMPLES];
+	int					nsent, nrecv, reuse;
+	char				out[BUFFERSIZE];
+	size_t				outlen, outoff;
+	char				buffer[BUFFERSIZE];
+	size_t				fill;
+
+#ifdef ENABLE_IO_URING
+	int					uring;			/* Polled on the io_uring */
+	int					inflight;		/* Operations on the io_uring */
+	struct __kernel_timespec	ts[4];	/* Of the timeouts in the chain */
+#endif
+};
+
+struct htp_ctx {
+	int					ipversion;
+	int					tunnel;
+	char				httpversion[2];
+	char				*proxy, *proxyport;
+	void				(*log)( void *arg, int is_error, const char *message );
+	void				*logarg;
+
+	int					backend;
+	int					epfd, tfd;		/* HTP_BACKEND_EPOLL and _URING */
+	struct pollfd		*pfds;			/* HTP_BACKEND_POLL */
+	struct probe		**owners;
+	int					maxpfds;
+	struct resolver		*resolver;
+	int					nextid, pending;
+	struct probe		*probes;
+
+	struct htp_result	*results;		/* Queue of collected samples */
+	int					head, nresults, maxresults;
+
+	struct trace		trace;
+
+	struct hostcache	**hosts;
+	int					nhosts;
+	struct connection	pool[POOLSIZE];	/* Persistent proxy connections */
+#ifdef ENABLE_HTTPS
+	SSL_CTX				*ssl_ctx;
+	BIO_METHOD			*bio_method;	/* Sockets without SIGPIPE */
+#endif
+#ifdef ENABLE_IO_URING
+	struct uring		ring;
+#endif
+};
+
+
+static void htplog( struct htp_ctx *ctx, int is_error, char *format, ... ) {
+	va_list args;
+	char buf[128];
+
+	if ( ctx->log == NULL )
+		return;
+
+	va_start(args, format);
+	(void) vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	ctx->log( ctx->logarg, is_error, buf );
+}
+
+
+/* Errors of a poll are logged when it is done, not while measuring.
+   The first one is kept, it tells most.
+*/
+static void proberror( struct probe *p, char *format, ... ) {
+	va_list args;
+
+	if ( p->error[0] )
+		return;
+
+	va_start(args, format);
+	(void) vsnprintf(p->error, sizeof(p->error), format, args);
+	va_end(args);
+}
+
+
+/* Wall clock in microseconds, "when" is relative to the second */
+static long long timeofday( void ) {
+	struct timeval		tv;
+
+	gettimeofday( &tv, NULL );
+	return( (long long)tv.tv_sec * 1000000 + tv.tv_usec );
+}
+
+
+static void unresolver( struct resolver *r ) {
+	if ( __atomic_sub_fetch( &r->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+		close( r->fds[0] );
+		close( r->fds[1] );
+		free( r );
+	}
+}
+
+
+static void unlookup( struct lookup *l ) {
+	if ( __atomic_sub_fetch( &l->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+		if ( l->result )
+			freeaddrinfo( l->result );
+		unresolver( l->resolver );
+		free( l );
+	}
+}
+
+
+/* The resolver thread, a full pipe is readable already */
+static void *resolve( void *arg ) {
+	struct lookup		*l = arg;
+	char				c = 0;
+
+	l->error = getaddrinfo( l->name, l->service, &l->hints, &l->result );
+	__atomic_store_n( &l->done, 1, __ATOMIC_RELEASE );
+	if ( write( l->resolver->fds[1], &c, 1 ) < 0 )
+		c = 1;
+	unlookup( l );
+	return( NULL );
+}
+
+
+/* Record a trace event, nothing is formatted or written here */
+static void trace( struct htp_ctx *ctx, struct probe *p, int type, int sample, long long value, long long time ) {
+	struct trace		*t = &ctx->trace;
+	struct htp_event	*e;
+	unsigned int		tail;
+
+	if ( t->size == 0 )
+		return;
+
+	tail = t->tail;
+	if ( tail - __atomic_load_n( &t->head, __ATOMIC_ACQUIRE ) == t->size ) {
+		__atomic_fetch_add( &t->dropped, 1, __ATOMIC_RELAXED );
+		return;
+	}
+
+	e = &t->events[tail & (t->size - 1)];
+	e->time = time;
+	e->value = value;
+	e->id = p->id;
+	e->sample = sample;
+	e->type = type;
+	__atomic_store_n( &t->tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+
+/* Insertion sort is more efficient (and smaller) than qsort for small lists */
+static void insertsort( int a[], int length ) {
+	int i, j, value;
+
+	for ( i = 1; i < length; i++ ) {
+		value = a[i];
+		for ( j = i - 1; j >= 0 && a[j] > value; j-- )
+			a[j+1] = a[j];
+		a[j+1] = value;
+	}
+}
+
+
+/* Split argument in hostname/IP-address and TCP port
+   Supports IPv6 literal addresses, RFC 2732.
+*/
+static void splithostport( char **host, char **port ) {
+	char    *rb, *rc, *lb, *lc;
+
+	lb = strchr( *host, '[' );
+	rb = strrchr( *host, ']' );
+	lc = strchr( *host, ':' );
+	rc = strrchr( *host, ':' );
+
+	/* A (litteral) IPv6 address with portnumber */
+	if ( rb < rc && lb != NULL && rb != NULL ) {
+		rb[0] = '\0';
+	    *port = rc + 1;
+		*host = lb + 1;
+		return;
+	}
+
+    /* A (litteral) IPv6 address without portnumber */
+	if ( rb != NULL && lb != NULL ) {
+		rb[0] = '\0';
+		*host = lb + 1;
+		return;
+	}
+
+	/* A IPv4 address or hostname with portnumber */
+	if ( rc != NULL && lc == rc ) {
+		rc[0] = '\0';
+		*port = rc + 1;
+		return;
+	}
+}
+
+
+/* Find the cache entry of host, a new entry is added if not found */
+static struct hostcache *findhost( struct htp_ctx *ctx, char *host ) {
+	struct hostcache	**hosts, *cache;
+	int					i;
+
+	for ( i = 0; i < ctx->nhosts; i++ ) {
+		if ( strcmp( ctx->hosts[i]->host, host ) == 0 )
+			return( ctx->hosts[i] );
+	}
+
+	hosts = realloc( ctx->hosts, (ctx->nhosts + 1) * sizeof(*hosts) );
+	if ( hosts == NULL )
+		return( NULL );
+	ctx->hosts = hosts;
+
+	if ( (cache = calloc( 1, sizeof(*cache) )) == NULL )
+		return( NULL );
+	strncpy( cache->host, host, sizeof(cache->host) - 1 );
+	cache->family = AF_UNSPEC;
+	ctx->hosts[ctx->nhosts++] = cache;
+
+	return( cache );
+}
+
+
+#ifdef ENABLE_HTTPS
+/* Keep the TLS session (ticket) the server sent us for the next poll */
+static int newsession( SSL *ssl, SSL_SESSION *session ) {
+	struct hostcache	*cache = SSL_get_app_data( ssl );
+
+	if ( cache == NULL || !SSL_SESSION_is_resumable( session ) )
+		return(0);
+
+	if ( cache->session )
+		SSL_SESSION_free( cache->session );
+	cache->session = session;
+
+	return(1);					/* We own the session now */
+}
+
+
+/* OpenSSL's socket BIO writes with write(2), so a connection reset by
+   the web server would raise SIGPIPE in the program using the library.
+   This BIO sends with MSG_NOSIGNAL, the socket is in the BIO data.
+*/
+static int biowrite( BIO *bio, const char *buffer, int len ) {
+	int					rc;
+
+	BIO_clear_retry_flags( bio );
+	rc = send( (int)(intptr_t)BIO_get_data( bio ), buffer, len, MSG_NOSIGNAL );
+	if ( rc < 0 && ( errno == EAGAIN || errno == EINTR ) )
+		BIO_set_retry_write( bio );
+	return( rc );
+}
+
+
+static int bioread( BIO *bio, char *buffer, int len ) {
+	int					rc;
+
+	BIO_clear_retry_flags( bio );
+	rc = recv( (int)(intptr_t)BIO_get_data( bio ), buffer, len, 0 );
+	if ( rc < 0 && ( errno == EAGAIN || errno == EINTR ) )
+		BIO_set_retry_read( bio );
+	return( rc );
+}
+
+
+static long bioctrl( BIO *bio, int cmd, long num, void *ptr ) {
+	switch ( cmd ) {
+	case BIO_C_GET_FD:
+		if ( ptr )
+			*(int *)ptr = (int)(intptr_t)BIO_get_data( bio );
+		return( (intptr_t)BIO_get_data( bio ) );
+	case BIO_CTRL_FLUSH:
+		return(1);
+	}
+	return(0);
+}
+
+
+static int biocreate( BIO *bio ) {
+	BIO_set_init( bio, 1 );
+	return(1);
+}
+
+
+/* Setup TLS, only once; certificates are verified against the
+   default CA store, which can be overridden with SSL_CERT_FILE
+*/
+static int initssl( struct htp_ctx *ctx ) {
+	if ( ctx->ssl_ctx )
+		return(0);
+
+	if ( (ctx->ssl_ctx = SSL_CTX_new( TLS_client_method() )) == NULL )
+		return(-1);
+
+	ctx->bio_method = BIO_meth_new( BIO_get_new_index() | \
+		BIO_TYPE_SOURCE_SINK | BIO_TYPE_DESCRIPTOR, "htpdate socket" );
+	if ( ctx->bio_method == NULL || \
+	  !BIO_meth_set_write( ctx->bio_method, biowrite ) || \
+	  !BIO_meth_set_read( ctx->bio_method, bioread ) || \
+	  !BIO_meth_set_ctrl( ctx->bio_method, bioctrl ) || \
+	  !BIO_meth_set_create( ctx->bio_method, biocreate ) ) {
+		BIO_meth_free( ctx->bio_method );
+		ctx->bio_method = NULL;
+		SSL_CTX_free( ctx->ssl_ctx );
+		ctx->ssl_ctx = NULL;
+		return(-1);
+	}
+
+	SSL_CTX_set_min_proto_version( ctx->ssl_ctx, TLS1_2_VERSION );
+	SSL_CTX_set_verify( ctx->ssl_ctx, SSL_VERIFY_PEER, NULL );
+	SSL_CTX_set_default_verify_paths( ctx->ssl_ctx );
+
+	/* Sessions are cached per host by newsession(), not by OpenSSL */
+	SSL_CTX_set_session_cache_mode( ctx->ssl_ctx, \
+		SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE );
+	SSL_CTX_sess_set_new_cb( ctx->ssl_ctx, newsession );
+
+	return(0);
+}
+#endif
+
+
+/* Register fd with epoll for POLLIN and POLLOUT, or change them. The
+   poll backend has nothing to register, see pollset().
+*/
+static void epolladd( struct htp_ctx *ctx, int fd, unsigned int events, void *ptr, int modify ) {
+#ifdef HAVE_EPOLL
+	struct epoll_event	ev;
+
+	if ( ctx->epfd < 0 )
+		return;
+
+	ev.events = ( events & POLLIN ? EPOLLIN : 0 ) | \
+		( events & POLLOUT ? EPOLLOUT : 0 );
+	ev.data.ptr = ptr;
+	epoll_ctl( ctx->epfd, modify ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev );
+#endif
+}
+
+
+static void epolldel( struct htp_ctx *ctx, int fd ) {
+#ifdef HAVE_EPOLL
+	if ( ctx->epfd >= 0 )
+		epoll_ctl( ctx->epfd, EPOLL_CTL_DEL, fd, NULL );
+#endif
+}
+
+
+/* Change the events the connection is waited for */
+static void watch( struct htp_ctx *ctx, struct probe *p, unsigned int events ) {
+	if ( events == p->events )
+		return;
+
+	if ( events == 0 )
+		epolldel( ctx, p->conn.fd );
+	else
+		epolladd( ctx, p->conn.fd, events, p, p->events != 0 );
+	p->events = events;
+}
+
+
+/* Queue a sample for htp_result() */
+static struct htp_result *addresult( struct htp_ctx *ctx, struct probe *p, int sample, int status, long offset, long rtt ) {
+	struct htp_result	*results, *r;
+
+	if ( ctx->nresults == ctx->maxresults ) {
+		if ( ctx->head ) {
+			memmove( ctx->results, ctx->results + ctx->head, \
+				(ctx->nresults - ctx->head) * sizeof(*r) );
+			ctx->nresults -= ctx->head;
+			ctx->head = 0;
+		} else {
+			results = realloc( ctx->results, \
+				(ctx->maxresults * 2 + 16) * sizeof(*r) );
+			if ( results == NULL )
+				return( NULL );
+			ctx->results = results;
+			ctx->maxresults = ctx->maxresults * 2 + 16;
+		}
+	}
+
+	r = &ctx->results[ctx->nresults++];
+	memset( r, 0, sizeof(*r) );
+	r->id = p->id;
+	r->sample = sample;
+	r->status = status;
+	strcpy( r->host, p->host );
+	strcpy( r->port, p->port );
+	r->offset = offset;
+	r->rtt = rtt;
+
+	return( r );
+}
+
+
+static void htpclose( struct connection *conn ) {
+#ifdef ENABLE_HTTPS
+	if ( conn->ssl ) {
+		SSL_shutdown( conn->ssl );
+		SSL_free( conn->ssl );
+		conn->ssl = NULL;
+	}
+#endif
+	close( conn->fd );
+	conn->fd = -1;
+}
+
+
+/* Check out a persistent connection to the proxy server from the pool.
+   A connection that became readable while idle was closed by the proxy
+   server (or has unexpected data) and is thrown away.
+*/
+static int poolget( struct htp_ctx *ctx, char *key, struct connection *conn ) {
+	struct pollfd		pfd;
+	int					i;
+
+	for ( i = 0; i < POOLSIZE; i++ ) {
+		if ( ctx->pool[i].pool[0] == '\0' || strcmp( ctx->pool[i].pool, key ) )
+			continue;
+
+		*conn = ctx->pool[i];
+		ctx->pool[i].pool[0] = '\0';
+
+		pfd.fd = conn->fd;
+		pfd.events = POLLIN;
+		if ( poll( &pfd, 1, 0 ) == 0 )
+			return(0);
+
+		htpclose( conn );
+	}
+
+	return(-1);
+}
+
+
+/* Check a connection that is kept alive back in to the pool */
+static void poolput( struct htp_ctx *ctx, struct connection *conn ) {
+	int					i;
+
+	for ( i = 0; i < POOLSIZE; i++ ) {
+		if ( ctx->pool[i].pool[0] == '\0' ) {
+			ctx->pool[i] = *conn;
+			conn->fd = -1;
+			return;
+		}
+	}
+
+	htpclose( conn );
+}
+
+
+/* End the poll with status, samples without a response get status too.
+   A connection to the proxy server which is kept alive goes back to the
+   pool.
+*/
+static void finish( struct htp_ctx *ctx, struct probe *p, int status ) {
+	int					i;
+
+	for ( i = p->nrecv; i < p->count; i++ )
+		addresult( ctx, p, i, status, 0, 0 );
+
+	for ( i = 0; i < p->nstarted; i++ ) {
+		if ( p->fds[i] >= 0 ) {
+			epolldel( ctx, p->fds[i] );
+			close( p->fds[i] );
+			p->fds[i] = -1;
+		}
+	}
+
+	if ( p->lookup ) {
+		unlookup( p->lookup );
+		p->lookup = NULL;
+	}
+
+	if ( p->addrinfo ) {
+		freeaddrinfo( p->addrinfo );
+		p->addrinfo = NULL;
+	}
+
+	if ( p->conn.fd >= 0 ) {
+		watch( ctx, p, 0 );
+		if ( status == HTP_OK && p->reuse && p->conn.pool[0] )
+			poolput( ctx, &p->conn );
+		else
+			htpclose( &p->conn );
+	}
+
+	p->state = DONE;
+	p->deadline = 0;
+	ctx->pending--;
+	trace( ctx, p, HTP_EV_DONE, -1, status, timeofday() );
+
+	if ( p->error[0] )
+		htplog( ctx, 1, "%s", p->error );
+}
+
+
+/* Build a combined HTTP/1.0 and 1.1 HEAD request
+   Pragma: no-cache, "forces" an HTTP/1.0 and 1.1 compliant
+   web server to return a fresh timestamp
+   Connection: close, allows the server the immediately close the
+   connection after sending the response.
+*/
+static void headrequest( struct htp_ctx *ctx, struct probe *p, int keepalive ) {
+	char				url[URLSIZE + 32] = { '\0' };
+
+	if ( ctx->proxy && !p->tunnel )
+		snprintf( url, sizeof(url), strchr( p->host, ':' ) ? "http://[%s]:%s" : \
+			"http://%s:%s", p->host, p->port);
+
+	snprintf(p->out, BUFFERSIZE, "HEAD %s/ HTTP/1.%s\r\nHost: %s\r\nUser-Agent: htpdate/"HTPDATE_VERSION"\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nConnection: %s\r\n\r\n", url, ctx->httpversion, p->host, keepalive ? "keep-alive" : "close");
+	p->outlen = strlen( p->out );
+	p->outoff = 0;
+}
+
+
+/* Does the response header allow the connection to be kept alive? */
+static int keepalive( char *header ) {
+	return( strncmp( header, "HTTP/1.1 ", 9 ) == 0 && \
+		strcasestr( header, "\nConnection: close" ) == NULL );
+}
+
+
+/* What the response header tells about the web server */
+static void response( struct htp_result *r, char *header, long long received ) {
+	if ( r == NULL )
+		return;
+
+	r->received = received;
+	if ( strncmp( header, "HTTP/1.", 7 ) == 0 && \
+	  ( header[7] == '0' || header[7] == '1' ) )
+		r->httpversion = header[7] == '1' ? 11 : 10;
+	r->keepalive = keepalive( header );
+}
+
+
+/* Extract the Date: from a response header received at "received",
+   the time delta between web server time and system time goes to offset
+*/
+static int parsedate( struct probe *p, char *header, long long received, long *offset ) {
+	struct tm			tm;
+	char				remote_time[25] = { '\0' };
+	char				*pdate = NULL;
+
+	memset( &tm, 0, sizeof(tm) );
+
+	/* Look for the line that contains Date: */
+	if ( (pdate = strstr(header, "Date: ")) == NULL || strlen( pdate ) < 35 ) {
+		proberror( p, "%s no timestamp", p->host );
+		return( HTP_ERR_DATE );
+	}
+
+	strncpy(remote_time, pdate + 11, 24);
+
+	if ( strptime( remote_time, "%d %b %Y %T", &tm) == NULL ) {
+		proberror( p, "%s unknown time format", p->host );
+		return( HTP_ERR_DATE );
+	}
+
+	*offset = timegm( &tm ) - received / 1000000;
+
+	return( HTP_OK );
+}
+
+
+/* Name resolution is done by the thread of the lookup, check if it's
+   done. It signals the pipe of the resolver when a name is resolved.
+*/
+static int resolving( struct htp_ctx *ctx, struct probe *p ) {
+	struct addrinfo		*first[MAX_ADDRS], *other[MAX_ADDRS], *res;
+	struct hostcache	*cache;
+	int					nfirst = 0, nother = 0;
+	int					family, i, rc;
+
+	if ( !__atomic_load_n( &p->lookup->done, __ATOMIC_ACQUIRE ) ) {
+		p->deadline = 0;
+		return(0);
+	}
+
+	rc = p->lookup->error;
+	p->addrinfo = p->lookup->result;
+	p->lookup->result = NULL;
+	unlookup( p->lookup );
+	p->lookup = NULL;
+
+	/* Was the hostname and service resolvable? */
+	if ( rc ) {
+		proberror( p, "%s host or service unavailable", p->host );
+		finish( ctx, p, HTP_ERR_RESOLVE );
+		return(0);
+	}
+
+	/* Sort the addresses into the preferred family and the rest */
+	cache = findhost( ctx, p->name );
+	family = cache ? cache->family : AF_UNSPEC;
+	for ( res = p->addrinfo; res; res = res->ai_next ) {
+		if ( res->ai_family == family )
+			break;
+	}
+	if ( res == NULL )
+		family = p->addrinfo->ai_family;
+
+	for ( res = p->addrinfo; res; res = res->ai_next ) {
+		if ( res->ai_family == family && nfirst < MAX_ADDRS )
+			first[nfirst++] = res;
+		else if ( res->ai_family != family && nother < MAX_ADDRS )
+			other[nother++] = res;
+	}
+
+	/* Interleave the address families */
+	for ( i = 0; p->naddrs < MAX_ADDRS && (i < nfirst || i < nother); i++ ) {
+		if ( i < nfirst )
+			p->addrs[p->naddrs++] = first[i];
+		if ( i < nother && p->naddrs < MAX_ADDRS )
+			p->addrs[p->naddrs++] = other[i];
+	}
+
+	p->connstart = timeofday();
+	p->state = CONNECTING;
+	trace( ctx, p, HTP_EV_RESOLVE, -1, 0, p->connstart );
+
+	return(1);
+}
+
+
+/* Happy Eyeballs, RFC 8305
+   Start a non-blocking connect to each address in turn, interleaving
+   the address families, and give every attempt CONNECTION_ATTEMPT_DELAY
+   before the next one is started. The first connection to complete wins,
+   its family is remembered and tried first on the following polls.
+*/
+static int connecting( struct htp_ctx *ctx, struct probe *p ) {
+	struct addrinfo		*res;
+	struct pollfd		pfd;
+	struct hostcache	*cache;
+	socklen_t			len;
+	long long			now;
+	int					i, err, fd, winner = -1;
+	char				authority[URLSIZE + 16];
+
+	/* Check the attempts in progress */
+	for ( i = 0; i < p->nstarted && winner < 0; i++ ) {
+		if ( p->fds[i] < 0 )
+			continue;
+
+		pfd.fd = p->fds[i];
+		pfd.events = POLLOUT;
+		if ( poll( &pfd, 1, 0 ) <= 0 )
+			continue;
+
+		len = sizeof(err);
+		if ( getsockopt( p->fds[i], SOL_SOCKET, SO_ERROR, &err, &len ) \
+		  == 0 && err == 0 ) {
+			winner = i;
+			break;
+		}
+
+		/* A failed attempt, start the next one immediately */
+		epolldel( ctx, p->fds[i] );
+		close( p->fds[i] );
+		p->fds[i] = -1;
+		p->active--;
+		p->attempt = 0;
+	}
+
+	now = timeofday();
+
+	if ( winner >= 0 ) {
+		/* The winner stays registered, for POLLOUT */
+		p->conn.fd = p->fds[winner];
+		p->fds[winner] = -1;
+		p->events = POLLOUT;
+
+		cache = findhost( ctx, p->name );
+		if ( cache )
+			cache->family = p->addrs[winner]->ai_family;
+		trace( ctx, p, HTP_EV_CONNECT, -1, p->addrs[winner]->ai_family, now );
+
+		/* The TCP handshake takes one round trip to the proxy server,
+		   which is the proxy leg of every request on this connection
+		*/
+		strcpy( p->conn.pool, p->key );
+		p->conn.proxyrtt = ctx->proxy ? now - p->started[winner] : 0;
+
+		/* Abandon the attempts that lost the race */
+		for ( i = 0; i < p->nstarted; i++ ) {
+			if ( p->fds[i] >= 0 ) {
+				epolldel( ctx, p->fds[i] );
+				close( p->fds[i] );
+				p->fds[i] = -1;
+			}
+		}
+		freeaddrinfo( p->addrinfo );
+		p->addrinfo = NULL;
+
+		if ( p->tunnel ) {
+			p->state = TUNNELING;
+			snprintf( authority, sizeof(authority), strchr( p->host, ':' ) ? \
+				"[%s]:%s" : "%s:%s", p->host, p->port );
+			snprintf( p->out, BUFFERSIZE, "CONNECT %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: htpdate/"HTPDATE_VERSION"\r\n\r\n", authority, authority );
+			p->outlen = strlen( p->out );
+			p->outoff = 0;
+		} else {
+			p->state = p->https ? HANDSHAKING : REQUESTING;
+		}
+		return(1);
+	}
+
+	/* Start the next attempt, when the previous one had its chance */
+	while ( p->nstarted < p->naddrs && \
+	  ( !p->active || now >= p->attempt + CONNECTION_ATTEMPT_DELAY ) ) {
+		res = p->addrs[p->nstarted];
+		p->started[p->nstarted] = p->attempt = now;
+		fd = socket( res->ai_family, res->ai_socktype | SOCK_NONBLOCK | \
+			SOCK_CLOEXEC, res->ai_protocol );
+		if ( fd >= 0 && ( connect( fd, res->ai_addr, res->ai_addrlen ) == 0 \
+		  || errno == EINPROGRESS ) ) {
+			epolladd( ctx, fd, POLLOUT, p, 0 );
+			p->active++;
+		} else if ( fd >= 0 ) {
+			close( fd );
+			fd = -1;
+		}
+		p->fds[p->nstarted++] = fd;
+	}
+
+	/* All attempts failed, or took too long */
+	if ( !p->active || now >= p->connstart + CONNECT_TIMEOUT ) {
+		proberror( p, "%s connection failed", p->host );
+		finish( ctx, p, HTP_ERR_CONNECT );
+		return(0);
+	}
+
+	p->deadline = p->connstart + CONNECT_TIMEOUT;
+	if ( p->nstarted < p->naddrs && \
+	  p->attempt + CONNECTION_ATTEMPT_DELAY < p->deadline )
+		p->deadline = p->attempt + CONNECTION_ATTEMPT_DELAY;
+
+	return(0);
+}
+
+
+/* Open a tunnel to the web server through the proxy server, RFC 7231 4.3.6 */
+static int tunneling( struct htp_ctx *ctx, struct probe *p ) {
+	ssize_t				len;
+
+	p->deadline = p->connstart + CONNECT_TIMEOUT;
+	if ( timeofday() >= p->deadline ) {
+		proberror( p, "%s tunnel failed", p->host );
+		finish( ctx, p, HTP_ERR_TUNNEL );
+		return(0);
+	}
+
+	if ( p->outoff < p->outlen ) {
+		len = send( p->conn.fd, p->out + p->outoff, p->outlen - p->outoff, \
+			MSG_NOSIGNAL );
+		if ( len < 0 && errno == EAGAIN ) {
+			watch( ctx, p, POLLOUT );
+			return(0);
+		}
+		if ( len <= 0 ) {
+			proberror( p, "%s tunnel failed", p->host );
+			finish( ctx, p, HTP_ERR_TUNNEL );
+			return(0);
+		}
+		p->outoff += len;
+		return(1);
+	}
+
+	/* Read the proxy server response header, nothing more */
+	len = recv( p->conn.fd, p->buffer + p->fill, 1, 0 );
+	if ( len < 0 && errno == EAGAIN ) {
+		watch( ctx, p, POLLIN );
+		return(0);
+	}
+	if ( len <= 0 || p->fill == BUFFERSIZE - 2 ) {
+		proberror( p, "%s tunnel failed", p->host );
+		finish( ctx, p, HTP_ERR_TUNNEL );
+		return(0);
+	}
+	p->fill += len;
+	p->buffer[p->fill] = '\0';
+	if ( strstr( p->buffer, "\r\n\r\n" ) == NULL )
+		return(1);
+
+	/* Any 2xx status code means the tunnel is open */
+	if ( strncmp( p->buffer, "HTTP/1.", 7 ) || p->buffer[9] != '2' ) {
+		proberror( p, "%s tunnel refused: %.12s", p->host, p->buffer + 9 );
+		finish( ctx, p, HTP_ERR_TUNNEL );
+		return(0);
+	}
+
+	p->fill = 0;
+	p->state = p->https ? HANDSHAKING : REQUESTING;
+	trace( ctx, p, HTP_EV_TUNNEL, -1, 0, timeofday() );
+
+	return(1);
+}
+
+
+/* TLS handshake on the connection, resuming a cached session.
+   The handshake is done before the timed request, so that a full
+   handshake or a session resumption doesn't affect the measurement.
+*/
+static int handshaking( struct htp_ctx *ctx, struct probe *p ) {
+#ifdef ENABLE_HTTPS
+	struct hostcache	*cache;
+	SSL					*ssl = p->conn.ssl;
+	BIO					*bio;
+	const char			*reason;
+	char				hostport[URLSIZE + 8];
+	int					rc;
+
+	p->deadline = p->connstart + CONNECT_TIMEOUT;
+
+	if ( ssl == NULL ) {
+		if ( initssl( ctx ) || (ssl = SSL_new( ctx->ssl_ctx )) == NULL ) {
+			finish( ctx, p, HTP_ERR_TLS );
+			return(0);
+		}
+		p->conn.ssl = ssl;
+		if ( (bio = BIO_new( ctx->bio_method )) == NULL ) {
+			finish( ctx, p, HTP_ERR_TLS );
+			return(0);
+		}
+		BIO_set_data( bio, (void *)(intptr_t)p->conn.fd );
+		SSL_set_bio( ssl, bio, bio );
+
+		/* Web servers on other ports of the host have their own sessions */
+		snprintf( hostport, sizeof(hostport), "%s:%s", p->host, p->port );
+		cache = findhost( ctx, hostport );
+		SSL_set_app_data( ssl, cache );
+		SSL_set_tlsext_host_name( ssl, p->host );
+		SSL_set1_host( ssl, p->host );
+		if ( cache && cache->session )
+			SSL_set_session( ssl, cache->session );
+	}
+
+	if ( timeofday() < p->deadline ) {
+		rc = SSL_connect( ssl );
+		if ( rc == 1 ) {
+			trace( ctx, p, HTP_EV_TLS, -1, SSL_version( ssl ) << 1 | \
+				SSL_session_reused( ssl ), timeofday() );
+			p->state = REQUESTING;
+			return(1);
+		}
+
+		switch ( SSL_get_error( ssl, rc ) ) {
+		case SSL_ERROR_WANT_READ:
+			watch( ctx, p, POLLIN );
+			return(0);
+		case SSL_ERROR_WANT_WRITE:
+			watch( ctx, p, POLLOUT );
+			return(0);
+		}
+
+		if ( (reason = ERR_reason_error_string( ERR_peek_last_error() )) )
+			proberror( p, "%s TLS handshake failed: %s", p->host, reason );
+		ERR_clear_error();
+	}
+#endif
+
+	proberror( p, "%s TLS handshake failed", p->host );
+	finish( ctx, p, HTP_ERR_TLS );
+	return(0);
+}
+
+
+static ssize_t htpsend( struct connection *conn, char *buffer, size_t len ) {
+#ifdef ENABLE_HTTPS
+	int					rc;
+
+	if ( conn->ssl ) {
+		if ( (rc = SSL_write( conn->ssl, buffer, len )) <= 0 && \
+		  SSL_get_error( conn->ssl, rc ) == SSL_ERROR_WANT_WRITE ) {
+			errno = EAGAIN;
+			return(-1);
+		}
+		return( rc );
+	}
+#endif
+	return( send( conn->fd, buffer, len, MSG_NOSIGNAL ) );
+}
+
+
+static ssize_t htprecv( struct connection *conn, char *buffer, size_t len ) {
+#ifdef ENABLE_HTTPS
+	int					rc;
+
+	if ( conn->ssl ) {
+		/* TLS records without application data, like session tickets */
+		if ( (rc = SSL_read( conn->ssl, buffer, len )) <= 0 && \
+		  SSL_get_error( conn->ssl, rc ) == SSL_ERROR_WANT_READ ) {
+			errno = EAGAIN;
+			return(-1);
+		}
+		return( rc );
+	}
+#endif
+	return( recv( conn->fd, buffer, len, 0 ) );
+}
+
+
+/* Send the HEAD requests when their time has come, the first at "when"
+   and the next ones nap microseconds apart. The last one asks the web
+   server to close the connection, unless it is a proxy connection which
+   is kept for the next poll. Responses arrive in order of the requests
+   (RFC 7230 6.3.2), so each response is matched to the oldest
+   outstanding request.
+*/
+static int requesting( struct htp_ctx *ctx, struct probe *p ) {
+	long long			now;
+	ssize_t				len;
+	long				rtt, offset;
+	int					status;
+	char				*eoh;
+
+	now = timeofday();
+
+	/* The first request is sent at "when", in this or the next second */
+	if ( p->start == 0 ) {
+		p->start = now - now % 1000000 + p->when;
+		if ( p->when < now % 1000000 )
+			p->start += 1000000;
+	}
+
+	if ( p->outoff == p->outlen && p->nsent < p->count && \
+	  now >= p->start + (long long)p->nsent * p->nap ) {
+		headrequest( ctx, p, p->nsent < p->count - 1 || \
+			( p->conn.pool[0] && ctx->httpversion[0] == '1' ) );
+		p->sent[p->nsent++] = now;
+	}
+
+	if ( p->outoff < p->outlen ) {
+		len = htpsend( &p->conn, p->out + p->outoff, p->outlen - p->outoff );
+		if ( len < 0 && errno == EAGAIN ) {
+			watch( ctx, p, POLLIN | POLLOUT );
+		} else if ( len <= 0 ) {
+			proberror( p, "%s error sending", p->host );
+			finish( ctx, p, HTP_ERR_SEND );
+			return(0);
+		} else {
+			p->outoff += len;
+			if ( p->outoff == p->outlen )
+				trace( ctx, p, HTP_EV_SEND, p->nsent - 1, 0, timeofday() );
+		}
+	}
+	if ( p->outoff == p->outlen )
+		watch( ctx, p, POLLIN );
+
+	/* Receive data from the web server */
+	len = htprecv( &p->conn, p->buffer + p->fill, BUFFERSIZE - 1 - p->fill );
+	if ( len == 0 || (len < 0 && errno != EAGAIN) ) {
+		finish( ctx, p, HTP_ERR_RECV );
+		return(0);
+	}
+
+	if ( len > 0 ) {
+		/* Assuming that network delay (server->htpdate) is neglectable,
+		   the received web server time "should" match the local time.
+
+		   From RFC 2616 paragraph 14.18
+		   ...
+		   It SHOULD represent the best available approximation
+		   of the date and time of message generation, unless the
+		   implementation has no means of generating a reasonably
+		   accurate date and time.
+		   ...
+		*/
+		now = timeofday();
+		if ( p->fill == 0 )
+			trace( ctx, p, HTP_EV_FIRSTBYTE, p->nrecv, 0, now );
+		p->fill += len;
+		p->buffer[p->fill] = '\0';
+
+		/* A HEAD response is a header only, match every complete one */
+		while ( p->nrecv < p->nsent && \
+		  (eoh = strstr( p->buffer, "\r\n\r\n" )) != NULL ) {
+			eoh[2] = '\0';
+
+			/* rtt contains round trip time in micro seconds, without
+			   the proxy leg when via a proxy server
+			*/
+			rtt = now - p->sent[p->nrecv] - p->conn.proxyrtt;
+
+			offset = 0;
+			status = parsedate( p, p->buffer, now, &offset );
+			if ( status == HTP_OK )
+				trace( ctx, p, HTP_EV_DATE, p->nrecv, offset, timeofday() );
+			response( addresult( ctx, p, p->nrecv++, status, offset, rtt ), \
+				p->buffer, now );
+			p->reuse = keepalive( p->buffer );
+
+			p->fill -= eoh + 4 - p->buffer;
+			memmove( p->buffer, eoh + 4, p->fill + 1 );
+		}
+
+		if ( p->nrecv == p->count ) {
+			finish( ctx, p, HTP_OK );
+			return(0);
+		}
+
+		/* Header too large to match */
+		if ( p->fill == BUFFERSIZE - 1 ) {
+			finish( ctx, p, HTP_ERR_RECV );
+			return(0);
+		}
+
+		return(1);
+	}
+
+	/* Wait for a response, or till the next request is due */
+	if ( p->nsent < p->count ) {
+		p->deadline = p->start + (long long)p->nsent * p->nap;
+		if ( p->deadline <= now )
+			return(1);
+	} else {
+		p->deadline = p->sent[p->nsent - 1] + RESPONSE_TIMEOUT;
+		if ( p->deadline <= now ) {
+			proberror( p, "%s response timeout", p->host );
+			finish( ctx, p, HTP_ERR_TIMEOUT );
+		}
+	}
+
+	return(0);
+}
+
+
+#ifdef ENABLE_IO_URING
+/* io_uring backend for plain HTTP polls, without a proxy server
+
+   Every sample is one linked chain of operations, queued for all polls
+   and submitted in one io_uring_enter() per htp_process():
+
+   [CONNECT -> LINK_TIMEOUT ->] TIMEOUT (at "when") -> SEND -> LINK_TIMEOUT
+   -> RECV -> LINK_TIMEOUT
+
+   The connect is only in the chain of the first sample. The kernel sends
+   the request when the absolute timeout expires, without waking us up,
+   and the receive time is taken when the completion is reaped. The
+   socket is closed with a CLOSE queued when the poll ends, not linked
+   after the last RECV, so a response can still arrive in pieces.
+   There is no connection race: the address family that won before is
+   tried first, and the next address when a connect failed or took
+   longer than CONNECTION_ATTEMPT_DELAY. Needs Linux 5.19 or later.
+*/
+static void uringexit( struct uring *ring ) {
+	if ( ring->fd < 0 )
+		return;
+
+	if ( ring->sqes != MAP_FAILED )
+		munmap( ring->sqes, ring->entries * sizeof(struct io_uring_sqe) );
+	if ( ring->sq != MAP_FAILED )
+		munmap( ring->sq, ring->sqsize );
+	close( ring->fd );
+	ring->fd = -1;
+}
+
+
+static int uringsetup( struct uring *ring, unsigned int entries ) {
+	struct io_uring_params	params;
+	struct io_uring_probe	*probe;
+	/* The chain also needs flags which can't be probed: REALTIME (5.15)
+	   and ETIME_SUCCESS (5.16) timeouts, and cancel ANY (5.19). SOCKET
+	   is not used, it tells the kernel is 5.19 or later.
+	*/
+	static const int		ops[] = { IORING_OP_CONNECT, IORING_OP_TIMEOUT, \
+		IORING_OP_LINK_TIMEOUT, IORING_OP_SEND, IORING_OP_RECV, \
+		IORING_OP_CLOSE, IORING_OP_SOCKET };
+	size_t					i, cqsize;
+	int						missing = 1;
+
+	memset( &params, 0, sizeof(params) );
+	ring->fd = syscall( __NR_io_uring_setup, entries, &params );
+	if ( ring->fd < 0 )
+		return(-1);
+
+	/* Submission and completion queue share one mapping */
+	ring->sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if ( cqsize > ring->sqsize )
+		ring->sqsize = cqsize;
+	ring->entries = params.sq_entries;
+	ring->sq = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+
+	/* Completions must never be dropped */
+	if ( !(params.features & IORING_FEAT_SINGLE_MMAP) || \
+	  !(params.features & IORING_FEAT_NODROP) )
+		goto fail;
+
+	ring->sq = mmap( NULL, ring->sqsize, PROT_READ | PROT_WRITE, \
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+	ring->sqes = mmap( NULL, ring->entries * sizeof(struct io_uring_sqe), \
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, \
+		IORING_OFF_SQES );
+	if ( ring->sq == MAP_FAILED || ring->sqes == MAP_FAILED )
+		goto fail;
+
+	ring->sqhead = (unsigned int *)((char *)ring->sq + params.sq_off.head);
+	ring->sqtail = (unsigned int *)((char *)ring->sq + params.sq_off.tail);
+	ring->sqmask = *(unsigned int *)((char *)ring->sq + params.sq_off.ring_mask);
+	ring->sqarray = (unsigned int *)((char *)ring->sq + params.sq_off.array);
+	ring->sqflags = (unsigned int *)((char *)ring->sq + params.sq_off.flags);
+	ring->cqhead = (unsigned int *)((char *)ring->sq + params.cq_off.head);
+	ring->cqtail = (unsigned int *)((char *)ring->sq + params.cq_off.tail);
+	ring->cqmask = *(unsigned int *)((char *)ring->sq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->sq + params.cq_off.cqes);
+	ring->queued = 0;
+	ring->draining = 0;
+	ring->inflight = 0;
+
+	/* Are all the operations of a chain supported? */
+	probe = calloc( 1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op) );
+	if ( probe && syscall( __NR_io_uring_register, ring->fd, \
+	  IORING_REGISTER_PROBE, probe, 256 ) == 0 ) {
+		for ( i = 0, missing = 0; i < sizeof(ops) / sizeof(ops[0]); i++ ) {
+			if ( ops[i] > probe->last_op || \
+			  !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) )
+				missing++;
+		}
+	}
+	free( probe );
+	if ( missing == 0 )
+		return(0);
+
+fail:
+	uringexit( ring );
+	return(-1);
+}
+
+
+/* Submit the queued operations, and wait for a completion if asked */
+static void uringsubmit( struct htp_ctx *ctx, int wait ) {
+	int						n;
+
+	if ( ctx->ring.queued == 0 && !wait )
+		return;
+
+	n = syscall( __NR_io_uring_enter, ctx->ring.fd, ctx->ring.queued, \
+		wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+	if ( n < 0 && errno != EINTR ) {
+		htplog( ctx, 1, "io_uring_enter()" );
+		return;
+	}
+	if ( n > 0 )
+		ctx->ring.queued -= n;
+}
+
+
+/* Get a submission queue entry for an operation of a poll, the poll
+   and the operation are the user data of its completion.
+   Chains must not be split, so room for one is made first.
+*/
+static struct io_uring_sqe *uringsqe( struct htp_ctx *ctx, struct probe *p, int op, int opcode, int fd, int flags ) {
+	struct uring			*ring = &ctx->ring;
+	struct io_uring_sqe		*sqe;
+	unsigned int			tail, index;
+
+	tail = *ring->sqtail;
+	index = tail & ring->sqmask;
+	sqe = &ring->sqes[index];
+	memset( sqe, 0, sizeof(*sqe) );
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t)p | op;
+	ring->sqarray[index] = index;
+	__atomic_store_n( ring->sqtail, tail + 1, __ATOMIC_RELEASE );
+
+	ring->queued++;
+	if ( p ) {
+		p->inflight++;
+		ring->inflight++;
+	}
+
+	return( sqe );
+}
+
+
+static void uringroom( struct htp_ctx *ctx, unsigned int n ) {
+	struct uring			*ring = &ctx->ring;
+
+	if ( *ring->sqtail - __atomic_load_n( ring->sqhead, __ATOMIC_ACQUIRE ) \
+	  + n > ring->entries )
+		uringsubmit( ctx, 0 );
+}
+
+
+/* Time-out of the previous operation in the chain, "us" from its start */
+static void uringtimeout( struct htp_ctx *ctx, struct probe *p, struct __kernel_timespec *ts, long long us, int flags ) {
+	struct io_uring_sqe		*sqe;
+
+	ts->tv_sec = us / 1000000;
+	ts->tv_nsec = us % 1000000 * 1000;
+	sqe = uringsqe( ctx, p, URING_TIMEOUT, IORING_OP_LINK_TIMEOUT, -1, flags );
+	sqe->addr = (uintptr_t)ts;
+	sqe->len = 1;
+}
+
+
+/* End the poll, the socket is closed by the ring too. Operations left
+   in the chain after a failure are cancelled by the kernel.
+*/
+static void uringfinish( struct htp_ctx *ctx, struct probe *p, int status ) {
+	if ( p->conn.fd >= 0 ) {
+		uringroom( ctx, 1 );
+		uringsqe( ctx, p, URING_CLOSE, IORING_OP_CLOSE, p->conn.fd, 0 );
+		p->conn.fd = -1;
+	}
+
+	finish( ctx, p, status );
+}
+
+
+/* Receive (the rest of) a response */
+static void uringrecv( struct htp_ctx *ctx, struct probe *p ) {
+	struct io_uring_sqe		*sqe;
+
+	uringroom( ctx, 2 );
+	sqe = uringsqe( ctx, p, URING_RECV, IORING_OP_RECV, p->conn.fd, \
+		IOSQE_IO_LINK );
+	sqe->addr = (uintptr_t)(p->buffer + p->fill);
+	sqe->len = BUFFERSIZE - 1 - p->fill;
+	uringtimeout( ctx, p, &p->ts[2], RESPONSE_TIMEOUT, 0 );
+}
+
+
+/* Send the next request at its time and receive the response.
+   The request leaves when the absolute timeout expires, so that is
+   the send time; unless the connection wasn't up yet.
+*/
+static void uringrequest( struct htp_ctx *ctx, struct probe *p ) {
+	struct io_uring_sqe		*sqe;
+	long long				due, now;
+
+	due = p->start + (long long)p->nsent * p->nap;
+	headrequest( ctx, p, p->nsent < p->count - 1 );
+	now = timeofday();
+	p->sent[p->nsent++] = due > now ? due : now;
+
+	uringroom( ctx, 6 );
+	p->ts[0].tv_sec = due / 1000000;
+	p->ts[0].tv_nsec = due % 1000000 * 1000;
+	sqe = uringsqe( ctx, p, URING_TIMEOUT, IORING_OP_TIMEOUT, -1, \
+		IOSQE_IO_LINK );
+	sqe->addr = (uintptr_t)&p->ts[0];
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_REALTIME | \
+		IORING_TIMEOUT_ETIME_SUCCESS;
+
+	sqe = uringsqe( ctx, p, URING_SEND, IORING_OP_SEND, p->conn.fd, \
+		IOSQE_IO_LINK );
+	sqe->addr = (uintptr_t)p->out;
+	sqe->len = p->outlen;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	uringtimeout( ctx, p, &p->ts[1], RESPONSE_TIMEOUT, IOSQE_IO_LINK );
+
+	uringrecv( ctx, p );
+}
+
+
+/* Connect to the next address of the web server and queue the first
+   sample
+*/
+static int uringstart( struct htp_ctx *ctx, struct probe *p ) {
+	struct io_uring_sqe		*sqe;
+	struct addrinfo			*res = NULL;
+	long long				now;
+
+	for ( ; p->nstarted < p->naddrs; p->nstarted++ ) {
+		res = p->addrs[p->nstarted];
+		p->conn.fd = socket( res->ai_family, res->ai_socktype | SOCK_CLOEXEC, \
+			res->ai_protocol );
+		if ( p->conn.fd >= 0 )
+			break;
+	}
+	if ( p->conn.fd < 0 ) {
+		proberror( p, "%s connection failed", p->host );
+		finish( ctx, p, HTP_ERR_CONNECT );
+		return(0);
+	}
+	p->nsent = 0;
+	p->fill = 0;
+
+	/* The first request is sent at "when", in this or the next second */
+	now = timeofday();
+	p->start = now - now % 1000000 + p->when;
+	if ( p->when < now % 1000000 )
+		p->start += 1000000;
+
+	/* Timed by the kernel from now on */
+	p->state = URING;
+	p->deadline = 0;
+	uringroom( ctx, 8 );
+	sqe = uringsqe( ctx, p, URING_CONNECT, IORING_OP_CONNECT, p->conn.fd, \
+		IOSQE_IO_LINK );
+	sqe->addr = (uintptr_t)res->ai_addr;
+	sqe->off = res->ai_addrlen;
+	uringtimeout( ctx, p, &p->ts[3], p->nstarted + 1 < p->naddrs ? \
+		CONNECTION_ATTEMPT_DELAY : CONNECT_TIMEOUT, IOSQE_IO_LINK );
+
+	uringrequest( ctx, p );
+
+	return(0);
+}
+
+
+/* A completion of a poll */
+static void uringcomplete( struct htp_ctx *ctx, struct probe *p, int op, int res, long long now ) {
+	struct hostcache		*cache;
+	long					rtt, offset;
+	int						status;
+	char					*eoh;
+
+	p->inflight--;
+	ctx->ring.inflight--;
+
+	/* After a failed connect the rest of the chain is cancelled, the
+	   next address is tried once the kernel let go of it; not when the
+	   connect was cancelled by htp_free()
+	*/
+	if ( p->state == CONNECTING ) {
+		if ( p->inflight == 0 && ctx->ring.draining )
+			finish( ctx, p, HTP_ERR_TIMEOUT );
+		else if ( p->inflight == 0 )
+			uringstart( ctx, p );
+		return;
+	}
+
+	if ( p->state == DONE )
+		return;
+
+	switch ( op ) {
+	case URING_CONNECT:
+		if ( res < 0 && p->nstarted + 1 < p->naddrs ) {
+			uringroom( ctx, 1 );
+			uringsqe( ctx, p, URING_CLOSE, IORING_OP_CLOSE, p->conn.fd, 0 );
+			p->conn.fd = -1;
+			p->nstarted++;
+			p->state = CONNECTING;
+			break;
+		}
+		if ( res < 0 ) {
+			proberror( p, "%s connection failed", p->host );
+			uringfinish( ctx, p, HTP_ERR_CONNECT );
+			break;
+		}
+		cache = findhost( ctx, p->name );
+		if ( cache )
+			cache->family = p->addrs[p->nstarted]->ai_family;
+		trace( ctx, p, HTP_EV_CONNECT, -1, p->addrs[p->nstarted]->ai_family, now );
+		if ( p->sent[0] < now )
+			p->sent[0] = now;
+		break;
+
+	case URING_SEND:
+		if ( res < (int)p->outlen ) {
+			proberror( p, "%s error sending", p->host );
+			uringfinish( ctx, p, HTP_ERR_SEND );
+			break;
+		}
+		trace( ctx, p, HTP_EV_SEND, p->nsent - 1, 0, now );
+		break;
+
+	case URING_RECV:
+		if ( res == -ECANCELED ) {
+			proberror( p, "%s response timeout", p->host );
+			uringfinish( ctx, p, HTP_ERR_TIMEOUT );
+			break;
+		}
+		if ( res <= 0 ) {
+			uringfinish( ctx, p, HTP_ERR_RECV );
+			break;
+		}
+
+		if ( p->fill == 0 )
+			trace( ctx, p, HTP_EV_FIRSTBYTE, p->nrecv, 0, now );
+		p->fill += res;
+		p->buffer[p->fill] = '\0';
+
+		/* A HEAD response is a header only */
+		if ( (eoh = strstr( p->buffer, "\r\n\r\n" )) == NULL ) {
+			if ( p->fill == BUFFERSIZE - 1 )
+				uringfinish( ctx, p, HTP_ERR_RECV );
+			else
+				uringrecv( ctx, p );
+			break;
+		}
+		eoh[2] = '\0';
+
+		rtt = now - p->sent[p->nrecv];
+		offset = 0;
+		status = parsedate( p, p->buffer, now, &offset );
+		if ( status == HTP_OK )
+			trace( ctx, p, HTP_EV_DATE, p->nrecv, offset, timeofday() );
+		response( addresult( ctx, p, p->nrecv++, status, offset, rtt ), \
+			p->buffer, now );
+		p->fill = 0;
+
+		if ( p->nrecv == p->count )
+			uringfinish( ctx, p, HTP_OK );
+		else
+			uringrequest( ctx, p );
+		break;
+	}
+}
+
+
+/* Reap the completions, each is timestamped as it is taken. Those
+   which didn't fit in the completion queue are kept by the kernel, they
+   are flushed into it by io_uring_enter().
+*/
+static void uringreap( struct htp_ctx *ctx ) {
+	struct uring			*ring = &ctx->ring;
+	struct io_uring_cqe		*cqe;
+	unsigned int			head, tail;
+	uint64_t				data;
+
+again:
+	head = *ring->cqhead;
+	tail = __atomic_load_n( ring->cqtail, __ATOMIC_ACQUIRE );
+	while ( head != tail ) {
+		cqe = &ring->cqes[head & ring->cqmask];
+		data = cqe->user_data;
+		if ( data & ~(uint64_t)URING_OPMASK )
+			uringcomplete( ctx, (struct probe *)(uintptr_t)(data & \
+				~(uint64_t)URING_OPMASK), data & URING_OPMASK, cqe->res, \
+				timeofday() );
+		head++;
+		__atomic_store_n( ring->cqhead, head, __ATOMIC_RELEASE );
+		tail = __atomic_load_n( ring->cqtail, __ATOMIC_ACQUIRE );
+	}
+
+	if ( __atomic_load_n( ring->sqflags, __ATOMIC_ACQUIRE ) & IORING_SQ_CQ_OVERFLOW ) {
+		syscall( __NR_io_uring_enter, ring->fd, 0, 0, IORING_ENTER_GETEVENTS, \
+			NULL, 0 );
+		goto again;
+	}
+}
+
+
+/* Cancel everything in flight, and wait till the kernel let go of it */
+static void uringdrain( struct htp_ctx *ctx ) {
+	struct io_uring_sqe		*sqe;
+
+	ctx->ring.draining = 1;
+	if ( ctx->ring.inflight ) {
+		uringroom( ctx, 1 );
+		sqe = uringsqe( ctx, NULL, 0, IORING_OP_ASYNC_CANCEL, -1, 0 );
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+	}
+
+	while ( ctx->ring.inflight ) {
+		uringsubmit( ctx, 1 );
+		uringreap( ctx );
+	}
+}
+#endif
+
+
+/* Advance the poll till it has to wait for an event */
+static void step( struct htp_ctx *ctx, struct probe *p ) {
+	int					again;
+
+	do {
+		switch ( p->state ) {
+		case RESOLVING:
+			again = resolving( ctx, p );
+			break;
+		case CONNECTING:
+#ifdef ENABLE_IO_URING
+			if ( p->uring ) {
+				again = uringstart( ctx, p );
+				break;
+			}
+#endif
+			again = connecting( ctx, p );
+			break;
+		case TUNNELING:
+			again = tunneling( ctx, p );
+			break;
+		case HANDSHAKING:
+			again = handshaking( ctx, p );
+			break;
+		case REQUESTING:
+			again = requesting( ctx, p );
+			break;
+		default:
+			again = 0;
+		}
+	} while ( again && p->state != DONE );
+}
+
+
+/* The earliest timed event, 0 if there is none */
+static long long nextdeadline( struct htp_ctx *ctx ) {
+	struct probe		*p;
+	long long			deadline = 0;
+
+	for ( p = ctx->probes; p; p = p->next ) {
+		if ( p->state != DONE && p->deadline && \
+		  ( !deadline || p->deadline < deadline ) )
+			deadline = p->deadline;
+	}
+
+	return( deadline );
+}
+
+
+/* Arm the timerfd for the earliest timed event, epoll only */
+static void armtimer( struct htp_ctx *ctx ) {
+#ifdef HAVE_EPOLL
+	struct itimerspec	its;
+	long long			deadline;
+
+	if ( ctx->tfd < 0 )
+		return;
+
+	deadline = nextdeadline( ctx );
+	memset( &its, 0, sizeof(its) );
+	its.it_value.tv_sec = deadline / 1000000;
+	its.it_value.tv_nsec = deadline % 1000000 * 1000;
+	timerfd_settime( ctx->tfd, TFD_TIMER_ABSTIME, &its, NULL );
+#endif
+}
+
+
+static void addpollfd( struct pollfd *fds, struct probe **owners, int max, int *n, int fd, short events, struct probe *p ) {
+	if ( *n < max ) {
+		fds[*n].fd = fd;
+		fds[*n].events = events;
+		fds[*n].revents = 0;
+		if ( owners )
+			owners[*n] = p;
+	}
+	(*n)++;
+}
+
+
+/* Collect the file descriptors to poll, and the polls they belong to
+   (NULL for the resolver). Returns how many there are, which may be
+   more than max.
+*/
+static int pollset( struct htp_ctx *ctx, struct pollfd *fds, struct probe **owners, int max ) {
+	struct probe		*p;
+	int					i, n = 0;
+
+	if ( ctx->epfd >= 0 ) {
+		addpollfd( fds, owners, max, &n, ctx->epfd, POLLIN, NULL );
+		return( n );
+	}
+
+	addpollfd( fds, owners, max, &n, ctx->resolver->fds[0], POLLIN, NULL );
+	for ( p = ctx->probes; p; p = p->next ) {
+		if ( p->state == CONNECTING ) {
+			/* Every attempt of the connection race */
+			for ( i = 0; i < p->nstarted; i++ ) {
+				if ( p->fds[i] >= 0 )
+					addpollfd( fds, owners, max, &n, p->fds[i], POLLOUT, p );
+			}
+		} else if ( p->state != DONE && p->conn.fd >= 0 && p->events ) {
+			addpollfd( fds, owners, max, &n, p->conn.fd, p->events, p );
+		}
+	}
+
+	return( n );
+}
+
+
+/* The poll set of the context, grown as needed */
+static int pollfds( struct htp_ctx *ctx ) {
+	struct pollfd		*pfds;
+	struct probe		**owners;
+	int					n, max;
+
+	n = pollset( ctx, ctx->pfds, ctx->owners, ctx->maxpfds );
+	if ( n <= ctx->maxpfds )
+		return( n );
+
+	for ( max = ctx->maxpfds ? ctx->maxpfds : MAX_POLLFDS; max < n; max <<= 1 );
+	pfds = realloc( ctx->pfds, max * sizeof(*pfds) );
+	if ( pfds )
+		ctx->pfds = pfds;
+	owners = realloc( ctx->owners, max * sizeof(*owners) );
+	if ( owners )
+		ctx->owners = owners;
+	if ( pfds && owners )
+		ctx->maxpfds = max;
+
+	/* Without memory the rest waits for its deadline */
+	n = pollset( ctx, ctx->pfds, ctx->owners, ctx->maxpfds );
+	return( n < ctx->maxpfds ? n : ctx->maxpfds );
+}
+
+
+/* Some name was resolved, check all */
+static void resolved( struct htp_ctx *ctx ) {
+	struct probe		*p;
+	char				buf[64];
+
+	while ( read( ctx->resolver->fds[0], buf, sizeof(buf) ) > 0 );
+	for ( p = ctx->probes; p; p = p->next ) {
+		if ( p->state == RESOLVING )
+			p->ready = 1;
+	}
+}
+
+
+/* Start the lookup of the web server or proxy server of a poll */
+static int startlookup( struct htp_ctx *ctx, struct probe *p ) {
+	struct lookup		*l;
+	pthread_attr_t		attr;
+	pthread_t			thread;
+	int					rc;
+
+	if ( (l = calloc( 1, sizeof(*l) )) == NULL )
+		return(-1);
+
+	switch( ctx->ipversion ) {
+		case 4:					/* IPv4 only */
+			l->hints.ai_family = AF_INET;
+			break;
+		case 6:					/* IPv6 only */
+			l->hints.ai_family = AF_INET6;
+			break;
+		default:				/* Support IPv6 and IPv4 name resolution */
+			l->hints.ai_family = PF_UNSPEC;
+	}
+	l->hints.ai_socktype = SOCK_STREAM;
+	l->hints.ai_flags = AI_CANONNAME;
+
+	/* Connect to web server via proxy server or directly */
+	snprintf( l->name, URLSIZE, "%s", p->name );
+	snprintf( l->service, URLSIZE, "%s", ctx->proxy ? ctx->proxyport : p->port );
+	l->resolver = ctx->resolver;
+	l->refs = 2;
+	__atomic_add_fetch( &ctx->resolver->refs, 1, __ATOMIC_RELAXED );
+
+	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+	rc = pthread_create( &thread, &attr, resolve, l );
+	pthread_attr_destroy( &attr );
+	if ( rc ) {
+		l->refs = 1;
+		unlookup( l );
+		return(-1);
+	}
+
+	p->lookup = l;
+	return(0);
+}
+
+
+struct htp_ctx *htp_new( const struct htp_options *options ) {
+	struct htp_ctx		*ctx;
+#ifdef HAVE_EPOLL
+	struct epoll_event	ev;
+#endif
+	char				*proxy, *proxyport;
+	unsigned int		size;
+	int					backend = HTP_BACKEND_POLL;
+	int					i;
+
+	if ( (ctx = calloc( 1, sizeof(*ctx) )) == NULL )
+		return( NULL );
+
+	ctx->epfd = ctx->tfd = -1;
+	strcpy( ctx->httpversion, DEFAULT_HTTP_VERSION );
+	for ( i = 0; i < POOLSIZE; i++ )
+		ctx->pool[i].fd = -1;
+#ifdef ENABLE_IO_URING
+	ctx->ring.fd = -1;
+#endif
+
+	if ( options ) {
+		ctx->ipversion = options->ipversion;
+		ctx->tunnel = options->tunnel;
+		ctx->log = options->log;
+		ctx->logarg = options->logarg;
+		backend = options->backend;
+		if ( options->httpversion && options->httpversion[0] == '0' )
+			ctx->httpversion[0] = '0';
+		if ( options->proxy && (ctx->proxy = strdup( options->proxy )) ) {
+			proxy = ctx->proxy;
+			proxyport = DEFAULT_PROXY_PORT;
+			splithostport( &proxy, &proxyport );
+			ctx->proxyport = strdup( proxyport );
+			memmove( ctx->proxy, proxy, strlen( proxy ) + 1 );
+		}
+	}
+
+	/* The lookups signal the pipe of the resolver */
+	if ( (ctx->resolver = calloc( 1, sizeof(*ctx->resolver) )) == NULL ) {
+		htp_free( ctx );
+		return( NULL );
+	}
+	ctx->resolver->refs = 1;
+	if ( pipe( ctx->resolver->fds ) ) {
+		ctx->resolver->fds[0] = ctx->resolver->fds[1] = -1;
+		htp_free( ctx );
+		return( NULL );
+	}
+	for ( i = 0; i < 2; i++ ) {
+		fcntl( ctx->resolver->fds[i], F_SETFL, O_NONBLOCK );
+		fcntl( ctx->resolver->fds[i], F_SETFD, FD_CLOEXEC );
+	}
+
+	/* The trace buffer is allocated once, nothing grows while polling */
+	if ( options && options->trace > 0 ) {
+		for ( size = 16; size < (unsigned int)options->trace && size < 1 << 24; size <<= 1 );
+		if ( (ctx->trace.events = calloc( size, sizeof(struct htp_event) )) == NULL ) {
+			htp_free( ctx );
+			return( NULL );
+		}
+		ctx->trace.size = size;
+	}
+
+	ctx->backend = HTP_BACKEND_POLL;
+	if ( backend == HTP_BACKEND_POLL )
+		return( ctx );
+
+#ifdef HAVE_EPOLL
+	ctx->epfd = epoll_create1( EPOLL_CLOEXEC );
+	ctx->tfd = timerfd_create( CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC );
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if ( ctx->epfd < 0 || ctx->tfd < 0 || \
+	  epoll_ctl( ctx->epfd, EPOLL_CTL_ADD, ctx->tfd, &ev ) ) {
+		htp_free( ctx );
+		return( NULL );
+	}
+	ev.data.ptr = ctx->resolver;
+	if ( epoll_ctl( ctx->epfd, EPOLL_CTL_ADD, ctx->resolver->fds[0], &ev ) ) {
+		htp_free( ctx );
+		return( NULL );
+	}
+	ctx->backend = HTP_BACKEND_EPOLL;
+#else
+	if ( backend == HTP_BACKEND_EPOLL )
+		htplog( ctx, 1, "epoll not supported, using poll" );
+#endif
+
+	/* The ring signals completions on its file descriptor */
+	if ( backend == HTP_BACKEND_URING ) {
+#ifdef ENABLE_IO_URING
+		ev.events = EPOLLIN;
+		ev.data.ptr = &ctx->ring;
+		if ( uringsetup( &ctx->ring, URING_ENTRIES ) || \
+		  epoll_ctl( ctx->epfd, EPOLL_CTL_ADD, ctx->ring.fd, &ev ) ) {
+			uringexit( &ctx->ring );
+			htplog( ctx, 1, "io_uring not available, using %s", \
+				htp_backendname( ctx->backend ) );
+		} else {
+			ctx->backend = HTP_BACKEND_URING;
+		}
+#else
+		htplog( ctx, 1, "io_uring not supported, using %s", \
+			htp_backendname( ctx->backend ) );
+#endif
+	}
+
+	return( ctx );
+}
+
+
+void htp_free( struct htp_ctx *ctx ) {
+	struct probe		*p;
+	int					i;
+
+	if ( ctx == NULL )
+		return;
+
+#ifdef ENABLE_IO_URING
+	if ( ctx->ring.fd >= 0 ) {
+		uringdrain( ctx );
+		uringexit( &ctx->ring );
+	}
+#endif
+
+	while ( (p = ctx->probes) ) {
+		ctx->probes = p->next;
+		if ( p->state != DONE )
+			finish( ctx, p, HTP_ERR_TIMEOUT );
+		free( p );
+	}
+
+	for ( i = 0; i < POOLSIZE; i++ ) {
+		if ( ctx->pool[i].pool[0] )
+			htpclose( &ctx->pool[i] );
+	}
+
+	for ( i = 0; i < ctx->nhosts; i++ ) {
+#ifdef ENABLE_HTTPS
+		if ( ctx->hosts[i]->session )
+			SSL_SESSION_free( ctx->hosts[i]->session );
+#endif
+		free( ctx->hosts[i] );
+	}
+	free( ctx->hosts );
+
+#ifdef ENABLE_HTTPS
+	if ( ctx->ssl_ctx )
+		SSL_CTX_free( ctx->ssl_ctx );
+	if ( ctx->bio_method )
+		BIO_meth_free( ctx->bio_method );
+#endif
+
+	if ( ctx->resolver ) {
+		if ( ctx->resolver->fds[0] < 0 )
+			free( ctx->resolver );
+		else
+			unresolver( ctx->resolver );
+	}
+	if ( ctx->tfd >= 0 )
+		close( ctx->tfd );
+	if ( ctx->epfd >= 0 )
+		close( ctx->epfd );
+	free( ctx->pfds );
+	free( ctx->owners );
+	free( ctx->results );
+	free( ctx->trace.events );
+	free( ctx->proxy );
+	free( ctx->proxyport );
+	free( ctx );
+}
+
+
+int htp_submit( struct htp_ctx *ctx, const char *url, int when, int count, int nap ) {
+	struct probe		*p;
+	char				buffer[URLSIZE];
+	char				*host, *port;
+	int					i;
+
+	if ( (p = calloc( 1, sizeof(*p) )) == NULL )
+		return(-1);
+
+	/* [scheme://]host:port */
+	port = DEFAULT_HTTP_PORT;
+	if ( strncmp( url, "https://", 8 ) == 0 ) {
+		url += 8;
+		p->https = 1;
+		port = DEFAULT_HTTPS_PORT;
+	} else if ( strncmp( url, "http://", 7 ) == 0 ) {
+		url += 7;
+	}
+	strncpy( buffer, url, URLSIZE - 1 );
+	buffer[URLSIZE - 1] = '\0';
+	host = buffer;
+	splithostport( &host, &port );
+	strncpy( p->host, host, URLSIZE - 1 );
+	strncpy( p->port, port, sizeof(p->port) - 1 );
+
+#ifndef ENABLE_HTTPS
+	if ( p->https ) {
+		htplog( ctx, 1, "%s HTTPS not supported", p->host );
+		free( p );
+		return(-1);
+	}
+#endif
+
+	p->id = ctx->nextid++;
+	p->when = when;
+	p->nap = nap;
+	p->count = count < 1 ? 1 : count > HTP_MAX_SAMPLES ? HTP_MAX_SAMPLES : count;
+	p->conn.fd = -1;
+	for ( i = 0; i < MAX_ADDRS; i++ )
+		p->fds[i] = -1;
+
+	/* HTTPS via a proxy server needs a tunnel */
+	p->tunnel = ctx->proxy && ( ctx->tunnel || p->https );
+#ifdef ENABLE_IO_URING
+	/* TLS and proxy servers need the state machine */
+	p->uring = ctx->ring.fd >= 0 && !p->https && !ctx->proxy;
+#endif
+
+	if ( p->tunnel )
+		snprintf( p->key, KEYSIZE, "%s:%s %s://%s:%s", ctx->proxy, \
+			ctx->proxyport, p->https ? "https" : "http", p->host, p->port );
+	else if ( ctx->proxy )
+		snprintf( p->key, KEYSIZE, "%s:%s", ctx->proxy, ctx->proxyport );
+
+	p->next = ctx->probes;
+	ctx->probes = p;
+	ctx->pending++;
+	trace( ctx, p, HTP_EV_SUBMIT, -1, 0, timeofday() );
+
+	/* Connections to the proxy server are taken from the pool if
+	   possible: shared by all web servers for absolute-URI requests,
+	   or one CONNECT tunnel per web server.
+	*/
+	if ( ctx->proxy && poolget( ctx, p->key, &p->conn ) == 0 ) {
+		trace( ctx, p, HTP_EV_CONNECT, -1, 0, timeofday() );
+		p->state = REQUESTING;
+	} else {
+		p->name = ctx->proxy ? ctx->proxy : p->host;
+		p->state = RESOLVING;
+		if ( startlookup( ctx, p ) ) {
+			proberror( p, "%s host or service unavailable", p->host );
+			finish( ctx, p, HTP_ERR_RESOLVE );
+		}
+	}
+
+	step( ctx, p );
+#ifdef ENABLE_IO_URING
+	if ( ctx->ring.fd >= 0 )
+		uringsubmit( ctx, 0 );
+#endif
+	armtimer( ctx );
+
+	return( p->id );
+}
+
+
+int htp_fd( struct htp_ctx *ctx ) {
+	return( ctx->epfd );
+}
+
+
+int htp_pollfds( struct htp_ctx *ctx, struct pollfd *fds, int max ) {
+	return( pollset( ctx, fds, NULL, max ) );
+}
+
+
+int htp_timeout( struct htp_ctx *ctx ) {
+	long long			deadline, now;
+
+	if ( (deadline = nextdeadline( ctx )) == 0 )
+		return(-1);
+
+	now = timeofday();
+	if ( deadline <= now )
+		return(0);
+	if ( deadline - now >= (long long)INT_MAX * 1000 )
+		return( INT_MAX );
+	return( (deadline - now + 999) / 1000 );
+}
+
+
+int htp_backend( struct htp_ctx *ctx ) {
+	return( ctx->backend );
+}
+
+
+const char *htp_backendname( int backend ) {
+	switch ( backend ) {
+		case HTP_BACKEND_POLL:
+			return( "poll" );
+		case HTP_BACKEND_EPOLL:
+			return( "epoll" );
+		case HTP_BACKEND_URING:
+			return( "io_uring" );
+	}
+	return( "unknown" );
+}
+
+
+/* Mark the polls with events, poll(2) */
+static void pollevents( struct htp_ctx *ctx ) {
+	int					i, n;
+
+	n = pollfds( ctx );
+	if ( poll( ctx->pfds, n, 0 ) <= 0 )
+		return;
+
+	for ( i = 0; i < n; i++ ) {
+		if ( ctx->pfds[i].revents == 0 )
+			continue;
+		if ( ctx->owners[i] )
+			ctx->owners[i]->ready = 1;
+		else
+			resolved( ctx );
+	}
+}
+
+
+/* Mark the polls with events, epoll(7) */
+static void epollevents( struct htp_ctx *ctx ) {
+#ifdef HAVE_EPOLL
+	struct epoll_event	events[MAX_EVENTS];
+	uint64_t			expirations;
+	int					i, n;
+
+	n = epoll_wait( ctx->epfd, events, MAX_EVENTS, 0 );
+	for ( i = 0; i < n; i++ ) {
+		if ( events[i].data.ptr == NULL ) {
+			if ( read( ctx->tfd, &expirations, sizeof(expirations) ) < 0 )
+				expirations = 0;
+		} else if ( events[i].data.ptr == ctx->resolver ) {
+			resolved( ctx );
+#ifdef ENABLE_IO_URING
+		} else if ( events[i].data.ptr == &ctx->ring ) {
+			continue;
+#endif
+		} else {
+			((struct probe *)events[i].data.ptr)->ready = 1;
+		}
+	}
+#endif
+}
+
+
+int htp_process( struct htp_ctx *ctx ) {
+	struct probe		*p, **pp;
+	long long			now;
+
+	if ( ctx->epfd >= 0 )
+		epollevents( ctx );
+	else
+		pollevents( ctx );
+
+#ifdef ENABLE_IO_URING
+	if ( ctx->ring.fd >= 0 )
+		uringreap( ctx );
+#endif
+
+	now = timeofday();
+	for ( p = ctx->probes; p; p = p->next ) {
+		if ( p->state != DONE && \
+		  ( p->ready || (p->deadline && p->deadline <= now) ) ) {
+			p->ready = 0;
+			step( ctx, p );
+		}
+	}
+
+#ifdef ENABLE_IO_URING
+	/* Submit all chains queued by this round in one go */
+	if ( ctx->ring.fd >= 0 )
+		uringsubmit( ctx, 0 );
+#endif
+
+	/* Forget the finished polls, not before the kernel is done with them */
+	pp = &ctx->probes;
+	while ( (p = *pp) ) {
+#ifdef ENABLE_IO_URING
+		if ( p->state == DONE && p->inflight == 0 ) {
+#else
+		if ( p->state == DONE ) {
+#endif
+			*pp = p->next;
+			free( p );
+		} else {
+			pp = &p->next;
+		}
+	}
+
+	armtimer( ctx );
+
+	return( ctx->pending );
+}
+
+
+void htp_wait( struct htp_ctx *ctx ) {
+	while ( htp_process( ctx ) )
+		poll( ctx->pfds, pollfds( ctx ), htp_timeout( ctx ) );
+}
+
+
+int htp_result( struct htp_ctx *ctx, struct htp_result *result ) {
+	if ( ctx->head == ctx->nresults ) {
+		ctx->head = ctx->nresults = 0;
+		return(0);
+	}
+
+	*result = ctx->results[ctx->head++];
+	return(1);
+}
+
+
+int htp_trace( struct htp_ctx *ctx, struct htp_event *events, int max ) {
+	struct trace		*t = &ctx->trace;
+	unsigned int		head, tail;
+	int					n = 0;
+
+	if ( t->size == 0 )
+		return(0);
+
+	head = t->head;
+	tail = __atomic_load_n( &t->tail, __ATOMIC_ACQUIRE );
+	while ( head != tail && n < max )
+		events[n++] = t->events[head++ & (t->size - 1)];
+	__atomic_store_n( &t->head, head, __ATOMIC_RELEASE );
+
+	return( n );
+}
+
+
+unsigned long htp_trace_dropped( struct htp_ctx *ctx ) {
+	return( __atomic_load_n( &ctx->trace.dropped, __ATOMIC_RELAXED ) );
+}
+
+
+const char *htp_event_name( int type ) {
+	static const char	*names[] = { "submit", "resolve", "connect", \
+		"tunnel", "tls", "send", "firstbyte", "date", "done" };
+
+	if ( type < HTP_EV_SUBMIT || type > HTP_EV_DONE )
+		return( "unknown" );
+
+	return( names[type] );
+}
+
+
+const char *htp_strerror( int status ) {
+	static const char	*messages[] = { "ok", "host or service unavailable", \
+		"connection failed", "tunnel failed", "TLS handshake failed", \
+		"error sending", "no response", "no timestamp", "timeout" };
+
+	if ( status > 0 || status < HTP_ERR_TIMEOUT )
+		return( "unknown error" );
+
+	return( messages[-status] );
+}
+
+
+int htp_select( int timedelta[], int count, int *mean, long long *sum ) {
+	int					i, goodtimes = 0;
+
+	*mean = 0;
+	*sum = 0;
+	if ( count <= 0 )
+		return(0);
+
+	/* Sort the timedelta results */
+	insertsort( timedelta, count );
+
+	/* Mean time value */
+	*mean = timedelta[count/2];
+
+	/* Filter out the bogus timevalues. A timedelta which is more than
+	   1 seconde off from mean, is considered a 'false ticker'.
+	   NTP synced web servers can never be more off than a second.
+	*/
+	for ( i = 0; i < count; i++ ) {
+		if ( timedelta[i] - *mean <= 1 && timedelta[i] - *mean >= -1 ) {
+			*sum += timedelta[i];
+			goodtimes++;
+		}
+	}
+
+	return( goodtimes );
+}
+
+/* vim: set ts=4 sw=4: */